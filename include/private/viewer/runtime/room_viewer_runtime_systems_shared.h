@@ -24,11 +24,14 @@ namespace {
     constexpr int PAINTING_MIN_TRI_AREA2 = 220;
     constexpr int PAINTING_MIN_TRI_SPAN = 4;
     constexpr int PAINTING_MAX_AFFINE_REGISTER = 16384;
-    constexpr int ADJACENT_ROOM_DEPTH_BIAS = 1500000;
-    constexpr int TRANSITION_DECOR_DEPTH_BIAS = ADJACENT_ROOM_DEPTH_BIAS;
     constexpr bool ENABLE_PAINTING_QUADS = true;
     constexpr bool ENABLE_NPC_SPRITES = true;
     constexpr bool ENABLE_MINIMAP = true;
+    constexpr bool ENABLE_SPAN_COVERAGE = true;
+    constexpr bool ENABLE_AFFINE_FLOOR = true;
+    constexpr bool ENABLE_WINDOW_SPANS = false;
+    constexpr bool ENABLE_WIDE_SPANS = true;
+    constexpr bool ENABLE_SHELL_IMPOSTOR = false;
     constexpr bn::fixed NPC_FX = 20;
     constexpr bn::fixed NPC_FY = -15;
     constexpr bn::fixed NPC_FZ = -10;
@@ -238,11 +241,14 @@ namespace {
     struct room_spec
     {
         const fr::model_3d_item& model;
+        const str::viewer::TiledFloorItem& floor;
+        const str::viewer::ModelBounds& bounds;
         bn::fixed center_x;
         bn::fixed center_y;
         bn::fixed half_x;
         bn::fixed half_y;
-        const fr::model_3d_item* decor_model;
+        bn::span<const str::viewer::ModelLod> decor_lods;
+        const str::viewer::ModelBounds* decor_bounds;
         bn::fixed decor_x;
         bn::fixed decor_y;
         bn::fixed decor_half_width;
@@ -251,10 +257,13 @@ namespace {
     constexpr room_spec rooms[NUM_ROOMS] = {
         {
             str::model_3d_items::room_0,
+            str::model_3d_items::room_0_floor,
+            str::model_3d_items::room_0_bounds,
             bn::fixed(0),
             bn::fixed(0),
             bn::fixed(90),
             bn::fixed(60),
+            {},
             nullptr,
             0,
             0,
@@ -263,11 +272,14 @@ namespace {
         },
         {
             str::model_3d_items::room_1,
+            str::model_3d_items::room_1_floor,
+            str::model_3d_items::room_1_bounds,
             bn::fixed(60),
             bn::fixed(120),
             bn::fixed(60),
             bn::fixed(60),
-            &str::model_3d_items::books,
+            str::model_3d_items::books_lods,
+            &str::model_3d_items::books_bounds,
             bn::fixed(24),
             bn::fixed(-12),
             bn::fixed(4),
@@ -478,16 +490,20 @@ namespace {
     }
     bool room_has_decor(int room_id)
     {
-        return rooms[room_id].decor_model;
+        return ! rooms[room_id].decor_lods.empty();
     }
-    const fr::model_3d_item& room_decor_model(int room_id)
+    const bn::span<const str::viewer::ModelLod>& room_decor_lods(int room_id)
     {
-        return *rooms[room_id].decor_model;
+        return rooms[room_id].decor_lods;
+    }
+    const str::viewer::ModelBounds* room_decor_bounds(int room_id)
+    {
+        return rooms[room_id].decor_bounds;
     }
     bool overlaps_room_decor(int room_id, bn::fixed px, bn::fixed py)
     {
         const room_spec& room = rooms[room_id];
-        if(! room.decor_model)
+        if(room.decor_lods.empty())
         {
             return false;
         }
@@ -534,6 +550,14 @@ namespace {
     {
         return rooms[room_id].model;
     }
+    const str::viewer::TiledFloorItem& get_room_floor(int room_id)
+    {
+        return rooms[room_id].floor;
+    }
+    const str::viewer::ModelBounds& get_room_bounds(int room_id)
+    {
+        return rooms[room_id].bounds;
+    }
 }
 namespace str
 {
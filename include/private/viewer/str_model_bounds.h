@@ -0,0 +1,24 @@
+#ifndef STR_MODEL_BOUNDS_H
+#define STR_MODEL_BOUNDS_H
+#include "bn_assert.h"
+#include "bn_fixed.h"
+#include "fr_model_3d_item.h"
+namespace str::viewer
+{
+class ModelBounds
+{
+public:
+    constexpr ModelBounds(const fr::point_3d& center, bn::fixed radius) :
+        _center(center),
+        _radius(radius)
+    {
+        BN_ASSERT(radius > 0, "Invalid radius: ", radius);
+    }
+    [[nodiscard]] constexpr const fr::point_3d& center() const { return _center; }
+    [[nodiscard]] constexpr bn::fixed radius() const { return _radius; }
+private:
+    fr::point_3d _center;
+    bn::fixed _radius;
+};
+}
+#endif
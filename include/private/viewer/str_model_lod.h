@@ -0,0 +1,23 @@
+#ifndef STR_MODEL_LOD_H
+#define STR_MODEL_LOD_H
+#include "bn_assert.h"
+#include "fr_model_3d_item.h"
+namespace str::viewer
+{
+class ModelLod
+{
+public:
+    constexpr ModelLod(const fr::model_3d_item& item, int min_screen_radius) :
+        _item(&item),
+        _min_screen_radius(min_screen_radius)
+    {
+        BN_ASSERT(min_screen_radius >= 0, "Invalid min screen radius: ", min_screen_radius);
+    }
+    [[nodiscard]] constexpr const fr::model_3d_item& item() const { return *_item; }
+    [[nodiscard]] constexpr int min_screen_radius() const { return _min_screen_radius; }
+private:
+    const fr::model_3d_item* _item;
+    int _min_screen_radius;
+};
+}
+#endif
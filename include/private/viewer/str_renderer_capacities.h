@@ -0,0 +1,104 @@
+#ifndef STR_RENDERER_CAPACITIES_H
+#define STR_RENDERER_CAPACITIES_H
+#include <cstdint>
+#include <type_traits>
+#include "bn_limits.h"
+namespace str::viewer
+{
+struct DefaultRendererCapacities
+{
+    static constexpr int max_dynamic_models = 3;
+    static constexpr int max_sprites = 3;
+    static constexpr int max_billboard_batches = 2;
+    static constexpr int max_batch_billboards = 32;
+    static constexpr int max_billboard_frames = 4;
+    static constexpr int max_sprite_affine_mats = 13;
+    static constexpr int max_oam_sprites = 24;
+    static constexpr int max_vertices = 240;
+    static constexpr int max_faces = 192;
+    static constexpr int max_instanced_vertices = 96;
+    static constexpr int max_instanced_faces = 64;
+    static constexpr int max_hdma_sprites = 32;
+    static constexpr int max_ewram_size = 212 * 1024;
+};
+struct CompactRendererCapacities
+{
+    static constexpr int max_dynamic_models = 2;
+    static constexpr int max_sprites = 2;
+    static constexpr int max_billboard_batches = 1;
+    static constexpr int max_batch_billboards = 16;
+    static constexpr int max_billboard_frames = 2;
+    static constexpr int max_sprite_affine_mats = 8;
+    static constexpr int max_oam_sprites = 8;
+    static constexpr int max_vertices = 160;
+    static constexpr int max_faces = 128;
+    static constexpr int max_instanced_vertices = 48;
+    static constexpr int max_instanced_faces = 32;
+    static constexpr int max_hdma_sprites = 24;
+    static constexpr int max_ewram_size = 176 * 1024;
+};
+struct LargeRendererCapacities
+{
+    static constexpr int max_dynamic_models = 6;
+    static constexpr int max_sprites = 8;
+    static constexpr int max_billboard_batches = 4;
+    static constexpr int max_batch_billboards = 32;
+    static constexpr int max_billboard_frames = 4;
+    static constexpr int max_sprite_affine_mats = 13;
+    static constexpr int max_oam_sprites = 32;
+    static constexpr int max_vertices = 480;
+    static constexpr int max_faces = 384;
+    static constexpr int max_instanced_vertices = 192;
+    static constexpr int max_instanced_faces = 128;
+    static constexpr int max_hdma_sprites = 32;
+    static constexpr int max_ewram_size = 244 * 1024;
+};
+template<typename Capacities>
+class RendererCapacityTraits
+{
+public:
+    static constexpr int max_dynamic_models = Capacities::max_dynamic_models;
+    static constexpr int max_sprites = Capacities::max_sprites;
+    static constexpr int max_billboard_batches = Capacities::max_billboard_batches;
+    static constexpr int max_batch_billboards = Capacities::max_batch_billboards;
+    static constexpr int max_billboards = max_billboard_batches * max_batch_billboards;
+    static constexpr int max_billboard_frames = Capacities::max_billboard_frames;
+    static constexpr int max_sprite_affine_mats = Capacities::max_sprite_affine_mats;
+    static constexpr int max_affine_mat_ids = 16;
+    static constexpr int max_oam_sprites = Capacities::max_oam_sprites;
+    static constexpr int max_vertices = Capacities::max_vertices;
+    static constexpr int max_faces = Capacities::max_faces;
+    static constexpr int max_edges = max_faces * 4;
+    static constexpr int max_instanced_vertices = Capacities::max_instanced_vertices;
+    static constexpr int max_instanced_faces = Capacities::max_instanced_faces;
+    static constexpr int max_hdma_sprites = Capacities::max_hdma_sprites;
+    static constexpr int max_ewram_size = Capacities::max_ewram_size;
+    using vertex_index_type = std::conditional_t<
+            max_vertices <= bn::numeric_limits<uint8_t>::max(), uint8_t, uint16_t>;
+    static constexpr int max_render_items = max_faces + max_sprites;
+    using face_index_type = std::conditional_t<
+            max_render_items <= bn::numeric_limits<uint8_t>::max(), uint8_t, uint16_t>;
+    static_assert(max_dynamic_models > 0, "Invalid max dynamic models");
+    static_assert(max_sprites > 0, "Invalid max sprites");
+    static_assert(max_billboard_batches > 0, "Invalid max billboard batches");
+    static_assert(max_batch_billboards > 0 && max_billboards <= bn::numeric_limits<uint16_t>::max(),
+                  "Invalid max batch billboards");
+    static_assert(max_billboard_frames > 0 && max_billboard_frames <= bn::numeric_limits<uint8_t>::max(),
+                  "Invalid max billboard frames");
+    static_assert(max_sprite_affine_mats > 0 && max_sprite_affine_mats + 3 <= max_affine_mat_ids,
+                  "Sprite and wide span affine mats must fit in matrices 0-15 (HDMA OAM entries 64+ overwrite 16+)");
+    static_assert(max_oam_sprites > 0 && max_oam_sprites <= 64, "OAM sprites must fit in OAM entries 0-63");
+    static_assert(max_vertices > 0 && max_vertices <= bn::numeric_limits<uint16_t>::max(), "Invalid max vertices");
+    static_assert(max_faces > 0 && max_render_items <= bn::numeric_limits<uint16_t>::max(), "Invalid max faces");
+    static_assert(max_edges <= bn::numeric_limits<int16_t>::max(), "Too many edges for 16-bit edge indexes");
+    static_assert(max_instanced_vertices > 0 && max_instanced_vertices <= max_vertices,
+                  "Invalid max instanced vertices");
+    static_assert(max_instanced_faces > 0 && max_instanced_faces <= max_faces, "Invalid max instanced faces");
+    static_assert(max_hdma_sprites > 0 && max_hdma_sprites <= 64, "HDMA sprites must fit in OAM entries 64-127");
+};
+#ifndef STR_RENDERER_CAPACITIES
+    #define STR_RENDERER_CAPACITIES DefaultRendererCapacities
+#endif
+using RendererCapacities = RendererCapacityTraits<STR_RENDERER_CAPACITIES>;
+}
+#endif
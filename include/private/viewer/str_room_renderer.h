@@ -1,24 +1,62 @@
 #ifndef STR_ROOM_RENDERER_H
 #define STR_ROOM_RENDERER_H
 #include <cstdint>
+#include "bn_affine_bg_map_cell.h"
+#include "bn_affine_bg_map_ptr.h"
+#include "bn_affine_bg_ptr.h"
+#include "bn_bg_palette_ptr.h"
 #include "bn_color.h"
 #include "bn_display.h"
 #include "bn_fixed.h"
 #include "bn_intrusive_list.h"
 #include "bn_limits.h"
+#include "bn_optional.h"
 #include "bn_pool.h"
+#include "bn_rect_window_boundaries_hbe_ptr.h"
+#include "bn_regular_bg_item.h"
+#include "bn_regular_bg_map_cell.h"
+#include "bn_regular_bg_map_ptr.h"
+#include "bn_regular_bg_position_hbe_ptr.h"
+#include "bn_regular_bg_ptr.h"
+#include "bn_regular_bg_tiles_ptr.h"
 #include "bn_span.h"
 #include "bn_sprite_affine_mat_ptr.h"
 #include "bn_sprite_item.h"
 #include "bn_sprite_palette_ptr.h"
+#include "bn_sprite_ptr.h"
 #include "bn_sprite_tiles_ptr.h"
+#include "bn_tile.h"
+#include "bn_unique_ptr.h"
+#include "bn_utility.h"
 #include "bn_vector.h"
 #include "fr_model_3d_item.h"
+#include "private/viewer/str_model_bounds.h"
+#include "private/viewer/str_model_lod.h"
+#include "private/viewer/str_renderer_capacities.h"
+#include "private/viewer/str_tiled_floor_item.h"
+#ifndef STR_BITMAP_RENDERER
+    #define STR_BITMAP_RENDERER false
+#endif
+#ifndef STR_WINDOW_SPANS
+    #define STR_WINDOW_SPANS false
+#endif
 namespace str::viewer
 {
 inline constexpr int focal_length_shift = 8;
-inline constexpr int max_dynamic_models = 3;
-inline constexpr int max_sprites = 3;
+inline constexpr int max_dynamic_models = RendererCapacities::max_dynamic_models;
+inline constexpr int max_sprites = RendererCapacities::max_sprites;
+inline constexpr int max_billboard_batches = RendererCapacities::max_billboard_batches;
+inline constexpr int max_billboards = RendererCapacities::max_billboards;
+enum class RenderLayer : uint8_t
+{
+    adjacent_room_floor,
+    adjacent_room,
+    room_floor,
+    room_back,
+    dynamic,
+    room_front
+};
+inline constexpr int render_layers_count = 6;
 class Camera
 {
 public:
@@ -44,8 +82,27 @@ public:
         room_perspective,
         room_floor_only
     };
-    explicit Model(const fr::model_3d_item& item) : _item(item) {}
-    [[nodiscard]] const fr::model_3d_item& item() const { return _item; }
+    static constexpr int max_vertices = RendererCapacities::max_vertices;
+    static constexpr int max_faces = RendererCapacities::max_faces;
+    static constexpr int max_edges = RendererCapacities::max_edges;
+    static constexpr int max_lods = 3;
+    explicit Model(const fr::model_3d_item& item, const TiledFloorItem* floor_item = nullptr,
+                   const ModelBounds* bounds = nullptr);
+    Model(const bn::span<const ModelLod>& lods, const ModelBounds& bounds);
+    [[nodiscard]] const fr::model_3d_item& item() const { return *_item; }
+    [[nodiscard]] const TiledFloorItem* floor_item() const { return _floor_item; }
+    [[nodiscard]] const ModelBounds* bounds() const { return _bounds; }
+    [[nodiscard]] const bn::span<const ModelLod>& lods() const { return _lods; }
+    [[nodiscard]] int lod_index() const { return _lod_index; }
+    [[nodiscard]] int render_items_count() const { return _item->faces().size() + (_floor_item ? 1 : 0); }
+    [[nodiscard]] int edges_count() const { return _lod_edges_counts[_lod_index]; }
+    [[nodiscard]] const uint16_t* face_edge_indexes(int face_index) const
+    {
+        return _face_edge_indexes[_lod_face_offsets[_lod_index] + face_index];
+    }
+    [[nodiscard]] int reserved_vertices_count() const { return _reserved_vertices_count; }
+    [[nodiscard]] int reserved_render_items_count() const { return _reserved_render_items_count; }
+    [[nodiscard]] int reserved_edges_count() const { return _reserved_edges_count; }
     [[nodiscard]] const fr::point_3d& position() const { return _position; }
     void set_position(const fr::point_3d& position)
     {
@@ -87,6 +144,35 @@ public:
         }
         return result + _position;
     }
+    [[nodiscard]] fr::point_3d inverse_transform(const fr::point_3d& point) const
+    {
+        bn::fixed dx = point.x() - _position.x();
+        bn::fixed dy = point.y() - _position.y();
+        bn::fixed dz = point.z() - _position.z();
+        fr::point_3d result(
+            dx.safe_multiplication(_xx) + dy.safe_multiplication(_yx) + dz.safe_multiplication(_zx),
+            dx.safe_multiplication(_xy) + dy.safe_multiplication(_yy) + dz.safe_multiplication(_zy),
+            dx.safe_multiplication(_xz) + dy.safe_multiplication(_yz) + dz.safe_multiplication(_zz));
+        if(_scale != 1)
+        {
+            result.set_x(result.x() / _scale);
+            result.set_y(result.y() / _scale);
+            result.set_z(result.z() / _scale);
+        }
+        return result;
+    }
+    [[nodiscard]] fr::point_3d x_axis() const
+    {
+        return fr::point_3d(_xx, _xy, _xz);
+    }
+    [[nodiscard]] fr::point_3d y_axis() const
+    {
+        return fr::point_3d(_yx, _yy, _yz);
+    }
+    [[nodiscard]] fr::point_3d z_axis() const
+    {
+        return fr::point_3d(_zx, _zy, _zz);
+    }
     void set_rotation_matrix(
         bn::fixed xx, bn::fixed xy, bn::fixed xz,
         bn::fixed yx, bn::fixed yy, bn::fixed yz,
@@ -109,6 +195,15 @@ public:
             _touch();
         }
     }
+    [[nodiscard]] RenderLayer render_layer() const { return _render_layer; }
+    void set_render_layer(RenderLayer render_layer)
+    {
+        if(_render_layer != render_layer)
+        {
+            _render_layer = render_layer;
+            _touch();
+        }
+    }
     [[nodiscard]] bool double_sided() const { return _double_sided; }
     void set_double_sided(bool double_sided)
     {
@@ -120,7 +215,11 @@ public:
     }
     [[nodiscard]] uint16_t version() const { return _version; }
 private:
-    const fr::model_3d_item& _item;
+    friend class Renderer;
+    const fr::model_3d_item* _item;
+    const TiledFloorItem* _floor_item;
+    const ModelBounds* _bounds;
+    bn::span<const ModelLod> _lods;
     fr::point_3d _position;
     bn::fixed _scale = 1;
     bn::fixed _xx = 1;
@@ -137,8 +236,17 @@ private:
     bn::fixed _zx_zy;
     int _depth_bias = 0;
     LayeringMode _layering_mode = LayeringMode::none;
+    RenderLayer _render_layer = RenderLayer::dynamic;
     bool _double_sided = false;
     uint16_t _version = 1;
+    uint16_t _lod_version = 0;
+    uint8_t _lod_index = 0;
+    uint16_t _reserved_vertices_count = 0;
+    uint16_t _reserved_render_items_count = 0;
+    uint16_t _reserved_edges_count = 0;
+    uint16_t _lod_face_offsets[max_lods] = {};
+    uint16_t _lod_edges_counts[max_lods] = {};
+    alignas(int) uint16_t _face_edge_indexes[max_faces][4];
     void _touch()
     {
         ++_version;
@@ -147,11 +255,22 @@ private:
             _version = 1;
         }
     }
+    [[nodiscard]] int _add_edges(const fr::model_3d_item& item, const TiledFloorItem* floor_item, int face_offset);
+    void _set_lod_index(int lod_index)
+    {
+        if(_lod_index != lod_index)
+        {
+            _lod_index = uint8_t(lod_index);
+            _item = &_lods[lod_index].item();
+            _touch();
+        }
+    }
 };
 class SpriteItem
 {
 public:
     SpriteItem(const bn::sprite_item& item, int graphics_index);
+    [[nodiscard]] const bn::sprite_shape_size& shape_size() const { return _shape_size; }
     [[nodiscard]] int width() const { return _shape_size.width(); }
     [[nodiscard]] bn::sprite_size size() const { return _shape_size.size(); }
     [[nodiscard]] const bn::sprite_tiles_ptr& tiles() const { return _tiles; }
@@ -160,17 +279,12 @@ public:
     [[nodiscard]] const bn::sprite_palette_ptr& palette() const { return _palette; }
     [[nodiscard]] bn::sprite_palette_ptr& palette() { return _palette; }
     [[nodiscard]] int palette_id() const { return _palette_id; }
-    [[nodiscard]] const bn::sprite_affine_mat_ptr& affine_mat() const { return _affine_mat; }
-    [[nodiscard]] bn::sprite_affine_mat_ptr& affine_mat() { return _affine_mat; }
-    [[nodiscard]] int affine_mat_id() const { return _affine_mat_id; }
 private:
     bn::sprite_shape_size _shape_size;
     int _tiles_id;
     int _palette_id;
-    int _affine_mat_id;
     bn::sprite_tiles_ptr _tiles;
     bn::sprite_palette_ptr _palette;
-    bn::sprite_affine_mat_ptr _affine_mat;
 };
 class Sprite : public bn::intrusive_list_node_type
 {
@@ -200,24 +314,200 @@ private:
     bn::fixed _scale = 1;
     bool _horizontal_flip = false;
 };
+class BillboardBatch : public bn::intrusive_list_node_type
+{
+public:
+    static constexpr int max_billboards = RendererCapacities::max_batch_billboards;
+    static constexpr int max_frames = RendererCapacities::max_billboard_frames;
+    static constexpr int max_palettes = 4;
+    explicit BillboardBatch(const bn::sprite_item& item);
+    [[nodiscard]] const bn::sprite_shape_size& shape_size() const { return _shape_size; }
+    [[nodiscard]] int width() const { return _shape_size.width(); }
+    [[nodiscard]] int size() const { return _size; }
+    [[nodiscard]] bool full() const { return _size == max_billboards; }
+    [[nodiscard]] int palettes_count() const { return _palettes.size(); }
+    [[nodiscard]] const bn::sprite_palette_ptr& palette(int palette_index) const { return _palettes[palette_index]; }
+    [[nodiscard]] int palette_id(int palette_index) const { return _palette_ids[palette_index]; }
+    int add_palette(const bn::sprite_palette_ptr& palette);
+    int add(const fr::point_3d& position, bn::fixed scale = 1, int frame = 0);
+    void clear() { _size = 0; }
+    [[nodiscard]] fr::point_3d position(int index) const
+    {
+        return fr::point_3d(_xs[index], _ys[index], _zs[index]);
+    }
+    void set_position(int index, const fr::point_3d& position)
+    {
+        _xs[index] = position.x();
+        _ys[index] = position.y();
+        _zs[index] = position.z();
+    }
+    [[nodiscard]] bn::fixed scale(int index) const { return _scales[index]; }
+    void set_scale(int index, bn::fixed scale)
+    {
+        BN_ASSERT(scale > 0, "Invalid scale: ", scale);
+        _scales[index] = scale;
+    }
+    [[nodiscard]] int frame(int index) const { return _frames[index]; }
+    void set_frame(int index, int frame)
+    {
+        BN_ASSERT(frame >= 0 && frame < _item.tiles_item().graphics_count(), "Invalid frame: ", frame);
+        _frames[index] = uint16_t(frame);
+    }
+    [[nodiscard]] bool horizontal_flip(int index) const { return _horizontal_flips[index]; }
+    void set_horizontal_flip(int index, bool horizontal_flip)
+    {
+        _horizontal_flips[index] = horizontal_flip;
+    }
+    [[nodiscard]] int palette_index(int index) const { return _palette_indexes[index]; }
+    void set_palette_index(int index, int palette_index)
+    {
+        BN_ASSERT(palette_index >= 0 && palette_index < _palettes.size(), "Invalid palette index: ", palette_index);
+        _palette_indexes[index] = uint8_t(palette_index);
+    }
+    void begin_frame_tiles();
+    [[nodiscard]] int frame_tiles_index(int frame);
+    [[nodiscard]] const bn::sprite_tiles_ptr& frame_tiles(int frame_tiles_index) const
+    {
+        return _frame_tiles[frame_tiles_index];
+    }
+    [[nodiscard]] int frame_tiles_id(int frame_tiles_index) const { return _frame_tiles_ids[frame_tiles_index]; }
+private:
+    bn::sprite_item _item;
+    bn::sprite_shape_size _shape_size;
+    bn::vector<bn::sprite_palette_ptr, max_palettes> _palettes;
+    uint16_t _palette_ids[max_palettes];
+    bn::vector<bn::sprite_tiles_ptr, max_frames> _frame_tiles;
+    uint16_t _frame_tiles_frames[max_frames];
+    uint16_t _frame_tiles_ids[max_frames];
+    bool _frame_tiles_used[max_frames];
+    bn::fixed _xs[max_billboards];
+    bn::fixed _ys[max_billboards];
+    bn::fixed _zs[max_billboards];
+    bn::fixed _scales[max_billboards];
+    uint16_t _frames[max_billboards];
+    uint8_t _palette_indexes[max_billboards];
+    bool _horizontal_flips[max_billboards];
+    int _size = 0;
+};
+class SpriteAffineMatPool
+{
+public:
+    static constexpr int max_affine_mats = RendererCapacities::max_sprite_affine_mats;
+    static constexpr int max_affine_mat_ids = RendererCapacities::max_affine_mat_ids;
+    static constexpr int scale_shift = 4;
+    struct Key
+    {
+        int scale;
+        int rotation;
+        bool horizontal_flip;
+        [[nodiscard]] bool operator==(const Key& other) const
+        {
+            return scale == other.scale && rotation == other.rotation && horizontal_flip == other.horizontal_flip;
+        }
+    };
+    void assign(const Key* keys, int keys_count, uint8_t* indexes);
+    [[nodiscard]] const bn::sprite_affine_mat_ptr& affine_mat(int index) const { return _affine_mats[index]; }
+    [[nodiscard]] int affine_mat_id(int index) const { return _affine_mat_ids[index]; }
+    [[nodiscard]] int updates_count() const { return _updates_count; }
+private:
+    bn::vector<bn::sprite_affine_mat_ptr, max_affine_mats> _affine_mats;
+    Key _keys[max_affine_mats];
+    uint8_t _affine_mat_ids[max_affine_mats];
+    int _updates_count = 0;
+};
 class ScanlineRenderer
 {
 public:
     struct ScanlineSpan { int left_x; int right_x; };
+    static constexpr bool front_to_back = true;
+    static constexpr bool hdma_sprites = true;
     ScanlineRenderer();
     ~ScanlineRenderer() { _stop_hdma(); }
     void load_colors(const bn::span<const bn::color>& colors);
-    void begin_frame() { _frame_active = true; }
+    [[nodiscard]] bool span_coverage_enabled() const { return _span_coverage_enabled; }
+    void set_span_coverage_enabled(bool enabled) { _span_coverage_enabled = enabled; }
+#if STR_WINDOW_SPANS
+    [[nodiscard]] bool window_spans_enabled() const { return _window_spans_enabled; }
+#else
+    [[nodiscard]] bool window_spans_enabled() const { return false; }
+#endif
+    void set_window_spans_enabled(bool enabled);
+    [[nodiscard]] bool wide_spans_enabled() const { return _wide_spans_enabled; }
+    void set_wide_spans_enabled(bool enabled);
+    [[nodiscard]] int merged_spans_count() const { return _merged_spans_count; }
+    [[nodiscard]] int dropped_spans_count() const { return _dropped_spans_count; }
+    [[nodiscard]] bn::span<const uint8_t> scanline_overflow_counts() const
+    {
+        return bn::span<const uint8_t>(_scanline_overflow_counts);
+    }
+    void log_overflows() const;
+    void begin_frame();
+    [[nodiscard]] BN_CODE_IWRAM bool covered(int minimum_y, int maximum_y, int minimum_x, int maximum_x) const;
     BN_CODE_IWRAM void add_scanline_spans(unsigned minimum_y, unsigned maximum_y, int width, bool x_outside,
                                           int color_index, unsigned shading, const ScanlineSpan* scanline_spans);
+    BN_CODE_IWRAM void add_scanline_span(unsigned y, int left_x, int right_x, int color_index, unsigned shading);
     BN_CODE_IWRAM void add_sprite(unsigned minimum_y, unsigned maximum_y,
                                   uint16_t attr0, uint16_t attr1, uint16_t attr2);
     void commit_frame();
+    void replay_frame();
 private:
-    struct ScanlineSpriteAttributes { int attr1; int attr2; int segment_count; int segment_length_limit; };
+    struct ScanlineSpriteAttributes
+    {
+        int attr1;
+        int attr2;
+        int segment_count;
+        int segment_length_limit;
+        int merge_length_limit;
+        bool wide = false;
+    };
+    struct WideSpanSprite
+    {
+        uint16_t attr1;
+        uint8_t row;
+        uint8_t offset;
+    };
+    struct CoverageInterval { int16_t left_x; int16_t right_x; };
+    struct ScanlineSlot
+    {
+        uint8_t priority;
+        uint8_t left_x;
+    };
+    struct LastScanlineSpan
+    {
+        int16_t left_x;
+        int16_t right_x;
+        uint16_t attr1;
+        uint16_t attr2;
+        uint8_t slots_end;
+        uint8_t color_index;
+        uint8_t shading;
+        uint8_t length_limit;
+    };
+#if STR_WINDOW_SPANS
+    struct WindowSpan
+    {
+        int16_t left_x;
+        int16_t right_x;
+        uint8_t color_index;
+        uint8_t shading;
+    };
+#endif
     static constexpr int _max_palettes = 8;
+    static constexpr int _max_window_spans = 2;
+    static constexpr int _min_window_span_width = 64;
+    static constexpr int _window_fill_rows = _max_palettes * fr::face_3d::max_colors;
+    static constexpr int _window_fill_tiles_count = (_window_fill_rows + 7) / 8;
+    static constexpr int _window_fill_colors_count = ((_window_fill_rows / 16) + 1) * 16;
+    static constexpr int _window_fill_map_size = 32;
+    static constexpr int _wide_span_affine_mats_count = 3;
+    static constexpr int _min_wide_span_length = 63;
+    static constexpr int _max_wide_span_length = 127;
+    static constexpr int _max_coverage_intervals = 4;
     static constexpr int _oam_start_index = 64;
-    static constexpr int _max_hdma_sprites = 32;
+    static constexpr int _max_hdma_sprites = RendererCapacities::max_hdma_sprites;
+    static constexpr int _max_slot_priority = 254;
+    static constexpr uint8_t _pinned_slot_priority = 255;
+    static constexpr uint8_t _continuation_slot_left_x = 255;
     static constexpr int _hdma_source_size = (bn::display::height() + 1) * 4 * _max_hdma_sprites;
     class ColorTiles
     {
@@ -239,50 +529,343 @@ private:
         void load(const ColorTiles& color_tiles);
     };
     alignas(int) bn::vector<ColorTiles, fr::face_3d::max_colors> _color_tiles;
+#if STR_WINDOW_SPANS
+    class WindowFills
+    {
+    public:
+        bn::regular_bg_ptr first_bg;
+        bn::regular_bg_ptr second_bg;
+        bn::fixed positions[2][_max_window_spans][bn::display::height()] = {};
+        bn::pair<bn::fixed, bn::fixed> boundaries[2][_max_window_spans][bn::display::height()] = {};
+        bn::regular_bg_position_hbe_ptr first_position_hbe;
+        bn::regular_bg_position_hbe_ptr second_position_hbe;
+        bn::rect_window_boundaries_hbe_ptr first_boundaries_hbe;
+        bn::rect_window_boundaries_hbe_ptr second_boundaries_hbe;
+        int buffer_index = 0;
+        explicit WindowFills(const bn::regular_bg_item& bg_item);
+        ~WindowFills();
+    };
+#endif
     alignas(int) ColorTileIds _color_tile_ids[fr::face_3d::max_colors];
     alignas(int) bn::color _colors[fr::face_3d::max_colors];
     alignas(int) bn::vector<bn::sprite_palette_ptr, _max_palettes> _palettes;
     alignas(int) uint8_t _palette_ids[_max_palettes];
     alignas(int) uint8_t _scanline_sprite_counts[bn::display::height()] = {};
-    alignas(int) uint8_t _previous_scanline_sprite_counts_a[bn::display::height()] = {};
-    alignas(int) uint8_t _previous_scanline_sprite_counts_b[bn::display::height()] = {};
+    alignas(int) ScanlineSlot _scanline_slots[bn::display::height()][_max_hdma_sprites];
+    alignas(int) uint8_t _scanline_overflow_counts[bn::display::height()] = {};
+    alignas(int) CoverageInterval _coverage_intervals[bn::display::height()][_max_coverage_intervals];
+    alignas(int) uint8_t _coverage_interval_counts[bn::display::height()] = {};
+    alignas(int) LastScanlineSpan _last_scanline_spans[bn::display::height()] = {};
+#if STR_WINDOW_SPANS
+    alignas(int) WindowSpan _window_spans[bn::display::height()][_max_window_spans];
+    alignas(int) uint8_t _window_span_counts[bn::display::height()] = {};
+    alignas(int) bn::tile _window_fill_tiles[_window_fill_tiles_count * 2];
+    alignas(int) bn::regular_bg_map_cell _window_fill_cells[_window_fill_map_size * _window_fill_map_size] = {};
+    alignas(int) bn::color _window_fill_colors[_window_fill_colors_count] = {};
+    bn::optional<WindowFills> _window_fills;
+#endif
+    alignas(int) WideSpanSprite _wide_span_sprites[_max_wide_span_length - _min_wide_span_length + 1];
+    bn::vector<bn::sprite_affine_mat_ptr, _wide_span_affine_mats_count> _wide_span_affine_mats;
     alignas(int) uint16_t _hdma_source_a[_hdma_source_size];
     alignas(int) uint16_t _hdma_source_b[_hdma_source_size];
     uint16_t* _hdma_source = _hdma_source_a;
+    int _hdma_transfer_slots_a = _max_hdma_sprites;
+    int _hdma_transfer_slots_b = _max_hdma_sprites;
+    int _previous_used_slots = _max_hdma_sprites;
     bool _frame_active = false;
+    bool _frame_committed = false;
+    bool _span_coverage_enabled = false;
+#if STR_WINDOW_SPANS
+    bool _window_spans_enabled = false;
+#endif
+    bool _wide_spans_enabled = false;
+    int _merged_spans_count = 0;
+    int _dropped_spans_count = 0;
     [[nodiscard]] BN_CODE_IWRAM ScanlineSpriteAttributes _scanline_sprite_attributes(
         int width, int color_index, unsigned shading) const;
     [[nodiscard]] BN_CODE_IWRAM bool _clip_span_to_screen(int& left_x, int& right_x) const;
+    [[nodiscard]] BN_CODE_IWRAM bool _coverage_overlaps(
+        unsigned minimum_y, unsigned maximum_y, const ScanlineSpan* scanline_spans) const;
+    [[nodiscard]] BN_CODE_IWRAM bool _trim_covered_span(unsigned y, int& left_x, int& right_x) const;
+    BN_CODE_IWRAM void _add_covered_span(unsigned y, int left_x, int right_x);
+    BN_CODE_IWRAM void _remove_covered_span(unsigned y, int left_x, int right_x);
+    BN_CODE_IWRAM void _add_scanline_span(
+        unsigned y, int left_x, int right_x, int color_index, unsigned shading,
+        const ScanlineSpriteAttributes& sprite_attributes);
+    BN_CODE_IWRAM bool _emit_scanline_sprites(
+        unsigned y, int left_x, int right_x, int color_index, unsigned shading,
+        const ScanlineSpriteAttributes& sprite_attributes);
+#if STR_WINDOW_SPANS
+    [[nodiscard]] BN_CODE_IWRAM bool _assign_window_span(
+        unsigned y, int left_x, int right_x, int color_index, unsigned shading);
+#endif
+    [[nodiscard]] BN_CODE_IWRAM bool _merge_scanline_span(
+        unsigned y, int left_x, int right_x, int color_index, unsigned shading,
+        const ScanlineSpriteAttributes& sprite_attributes);
+    [[nodiscard]] BN_CODE_IWRAM int _emit_unclipped_scanline_spans(
+        unsigned minimum_y, unsigned maximum_y, int color_index, unsigned shading,
+        const ScanlineSpriteAttributes& sprite_attributes, const ScanlineSpan* scanline_spans);
+    BN_CODE_IWRAM void _count_dropped_span(unsigned y);
+    [[nodiscard]] BN_CODE_IWRAM int _evict_scanline_spans(unsigned y, int slot_count, int priority);
     [[nodiscard]] BN_CODE_IWRAM bool _reserve_scanline_slots(
-        unsigned y, int slot_count, uint16_t*& sprite_hdma_source);
+        unsigned y, int slot_count, int priority, ScanlineSlot first_slot, uint16_t*& sprite_hdma_source);
     BN_CODE_IWRAM void _write_scanline_sprite(
         uint16_t*& sprite_hdma_source, unsigned y, int attr1, int attr2, int left_x, int length);
+    BN_CODE_IWRAM void _write_wide_scanline_sprite(
+        uint16_t*& sprite_hdma_source, unsigned y, int attr1, int attr2, int left_x, int length);
     BN_CODE_IWRAM void _write_hidden_scanline_sprite(uint16_t*& sprite_hdma_source);
-    BN_CODE_IWRAM void _hide_left_scanline_sprites(const uint8_t* previous_scanline_sprite_counts);
+    BN_CODE_IWRAM void _pack_scanline_sprites(int transfer_slots);
+#if STR_WINDOW_SPANS
+    void _load_window_fill_colors();
+    void _commit_window_spans();
+#endif
+    void _start_hdma(const uint16_t* hdma_source, int transfer_slots);
+    void _stop_hdma();
+};
+class AffineFloorRenderer
+{
+public:
+    AffineFloorRenderer();
+    ~AffineFloorRenderer() { _stop_hdma(); }
+    void load_colors(const bn::span<const bn::color>& colors);
+    [[nodiscard]] bool enabled() const { return _bg.has_value(); }
+    void set_enabled(bool enabled);
+    void begin_frame() { _floor_added = false; }
+    [[nodiscard]] BN_CODE_IWRAM bool add_floor(
+        const TiledFloorItem& floor_item, unsigned shading, const int64_t (&screen_matrix)[9],
+        unsigned minimum_y, unsigned maximum_y, const ScanlineRenderer::ScanlineSpan* scanline_spans);
+    void commit_frame();
+    void replay_frame();
+private:
+    static constexpr int _map_size = 32;
+    static constexpr int _tile_texels = 16;
+    static constexpr int _tiles_count = fr::face_3d::max_colors + 1;
+    static constexpr int _palette_colors_count = 16;
+    static constexpr int _hdma_line_elements = 8;
+    static constexpr int _hdma_source_size = (bn::display::height() + 1) * _hdma_line_elements;
+    static_assert(TiledFloorItem::max_tiles * _tile_texels <= _map_size * 8);
+    static_assert(_tiles_count < _palette_colors_count);
+    alignas(int) bn::tile _tiles[_tiles_count * 2];
+    alignas(int) bn::affine_bg_map_cell _cells[_map_size * _map_size] = {};
+    alignas(int) bn::color _colors[fr::face_3d::max_colors] = {};
+    alignas(int) bn::color _palette_colors[_palette_colors_count] = {};
+    alignas(int) uint16_t _hdma_source_a[_hdma_source_size];
+    alignas(int) uint16_t _hdma_source_b[_hdma_source_size];
+    uint16_t* _hdma_source = _hdma_source_a;
+    bn::optional<bn::affine_bg_ptr> _bg;
+    bn::optional<bn::affine_bg_map_ptr> _bg_map;
+    const TiledFloorItem* _floor_item = nullptr;
+    int _colors_count = 0;
+    int _shading = -1;
+    bool _floor_added = false;
+    bool _floor_committed = false;
+    void _load_floor(const TiledFloorItem& floor_item, unsigned shading);
+    void _start_hdma(const uint16_t* hdma_source);
+    void _stop_hdma();
+};
+class BitmapRenderer
+{
+public:
+    using ScanlineSpan = ScanlineRenderer::ScanlineSpan;
+    static constexpr bool front_to_back = false;
+    static constexpr bool hdma_sprites = false;
+    BitmapRenderer();
+    ~BitmapRenderer() { _stop_hdma(); }
+    void load_colors(const bn::span<const bn::color>& colors);
+    [[nodiscard]] bool span_coverage_enabled() const { return false; }
+    void set_span_coverage_enabled(bool) {}
+    [[nodiscard]] bool window_spans_enabled() const { return false; }
+    void set_window_spans_enabled(bool) {}
+    [[nodiscard]] bool wide_spans_enabled() const { return false; }
+    void set_wide_spans_enabled(bool) {}
+    [[nodiscard]] int merged_spans_count() const { return 0; }
+    [[nodiscard]] int dropped_spans_count() const { return _dropped_sprites_count; }
+    [[nodiscard]] bn::span<const uint8_t> scanline_overflow_counts() const { return bn::span<const uint8_t>(); }
+    void log_overflows() const;
+    BN_CODE_IWRAM void begin_frame();
+    [[nodiscard]] bool covered(int, int, int, int) const { return false; }
+    BN_CODE_IWRAM void add_scanline_spans(unsigned minimum_y, unsigned maximum_y, int width, bool x_outside,
+                                          int color_index, unsigned shading, const ScanlineSpan* scanline_spans);
+    BN_CODE_IWRAM void add_scanline_span(unsigned y, int left_x, int right_x, int color_index, unsigned shading);
+    void add_sprite(unsigned minimum_y, unsigned maximum_y, uint16_t attr0, uint16_t attr1, uint16_t attr2);
+    void commit_frame();
+    void replay_frame();
+private:
+    static constexpr int _max_shading_levels = 8;
+    static constexpr int _palette_colors_count =
+            (((_max_shading_levels * fr::face_3d::max_colors) / 16) + 1) * 16;
+    static constexpr int _oam_start_index = 64;
+    alignas(int) bn::color _palette_colors[_palette_colors_count] = {};
+    alignas(int) uint16_t _display_controls[2][bn::display::height()];
+    static constexpr int _max_sprites =
+            max_sprites + max_billboards < 64 ? max_sprites + max_billboards : 64;
+    alignas(int) uint16_t _sprite_attributes[_max_sprites][3];
+    bn::optional<bn::bg_palette_ptr> _palette;
+    bn::sprite_tiles_ptr _reserved_sprite_tiles;
+    uint16_t* _back_page;
+    int _front_page = 0;
+    int _drawn_minimum_ys[2] = { 0, 0 };
+    int _drawn_maximum_ys[2] = { bn::display::height() - 1, bn::display::height() - 1 };
+    int _sprites_count = 0;
+    int _committed_sprites_count = 0;
+    int _dropped_sprites_count = 0;
+    bool _frame_active = false;
+    bool _frame_committed = false;
+    BN_CODE_IWRAM void _fill_scanline_span(unsigned y, int left_x, int right_x, int color_index, unsigned shading);
+    void _commit_sprites();
+    void _start_hdma();
     void _stop_hdma();
 };
+class ShellImpostor
+{
+public:
+    using ScanlineSpan = ScanlineRenderer::ScanlineSpan;
+    void load_colors(const bn::span<const bn::color>& colors);
+    [[nodiscard]] bool enabled() const { return _bg.has_value(); }
+    void set_enabled(bool enabled);
+    [[nodiscard]] bool valid() const { return _valid; }
+    [[nodiscard]] bool failed() const { return _failed; }
+    void invalidate();
+    void begin_bake();
+    void finish_bake();
+    BN_CODE_IWRAM void add_scanline_spans(unsigned minimum_y, unsigned maximum_y, int width, bool x_outside,
+                                          int color_index, unsigned shading, const ScanlineSpan* scanline_spans);
+    BN_CODE_IWRAM void add_scanline_span(unsigned y, int left_x, int right_x, int color_index, unsigned shading);
+private:
+    static constexpr int _max_tiles = 384;
+    static constexpr int _map_size = 32;
+    static constexpr int _map_columns_offset = ((_map_size * 8) - bn::display::width()) / 16;
+    static constexpr int _map_rows_offset = ((_map_size * 8) - bn::display::height()) / 16;
+    static constexpr int _max_shading_levels = 8;
+    static constexpr int _palette_colors_count =
+            (((_max_shading_levels * fr::face_3d::max_colors) / 16) + 1) * 16;
+    struct Buffers
+    {
+        alignas(int) uint8_t pixels[bn::display::height()][bn::display::width()];
+        alignas(int) bn::tile tiles[_max_tiles * 2];
+    };
+    bn::unique_ptr<Buffers> _buffers;
+    alignas(int) bn::regular_bg_map_cell _cells[_map_size * _map_size] = {};
+    alignas(int) bn::color _palette_colors[_palette_colors_count] = {};
+    bn::optional<bn::regular_bg_ptr> _bg;
+    bn::optional<bn::regular_bg_map_ptr> _bg_map;
+    bn::optional<bn::regular_bg_tiles_ptr> _bg_tiles;
+    bool _valid = false;
+    bool _failed = false;
+    BN_CODE_IWRAM void _fill_scanline_span(unsigned y, int left_x, int right_x, int color_index, unsigned shading);
+};
+#if STR_BITMAP_RENDERER
+    using SpanRenderer = BitmapRenderer;
+#else
+    using SpanRenderer = ScanlineRenderer;
+#endif
 class Renderer
 {
 public:
-    void load_colors(const bn::span<const bn::color>& colors) { _scanline_renderer.load_colors(colors); }
-    [[nodiscard]] Model& create_model(const fr::model_3d_item& model_item);
+    void load_colors(const bn::span<const bn::color>& colors)
+    {
+        _span_renderer.load_colors(colors);
+        _affine_floor_renderer.load_colors(colors);
+        _shell_impostor.load_colors(colors);
+        _frame_replay_valid = false;
+    }
+    [[nodiscard]] bool span_coverage_enabled() const { return _span_renderer.span_coverage_enabled(); }
+    [[nodiscard]] int merged_spans_count() const { return _span_renderer.merged_spans_count(); }
+    [[nodiscard]] int dropped_spans_count() const { return _span_renderer.dropped_spans_count(); }
+    [[nodiscard]] bn::span<const uint8_t> scanline_overflow_counts() const
+    {
+        return _span_renderer.scanline_overflow_counts();
+    }
+    void set_span_coverage_enabled(bool enabled)
+    {
+        _span_renderer.set_span_coverage_enabled(enabled);
+        _frame_replay_valid = false;
+    }
+    [[nodiscard]] bool affine_floor_enabled() const { return _affine_floor_renderer.enabled(); }
+    void set_affine_floor_enabled(bool enabled)
+    {
+        BN_ASSERT(! enabled || ! window_spans_enabled(), "Affine floor and window spans can't be enabled together");
+        BN_ASSERT(! enabled || ! shell_impostor_enabled(), "Affine floor and shell impostor can't be enabled together");
+        _affine_floor_renderer.set_enabled(enabled && ! STR_BITMAP_RENDERER);
+        _frame_replay_valid = false;
+    }
+    [[nodiscard]] bool window_spans_enabled() const { return _span_renderer.window_spans_enabled(); }
+    void set_window_spans_enabled(bool enabled)
+    {
+        BN_ASSERT(! enabled || ! affine_floor_enabled(), "Affine floor and window spans can't be enabled together");
+        BN_ASSERT(! enabled || ! shell_impostor_enabled(), "Window spans and shell impostor can't be enabled together");
+        _span_renderer.set_window_spans_enabled(enabled);
+        _frame_replay_valid = false;
+    }
+    [[nodiscard]] bool wide_spans_enabled() const { return _span_renderer.wide_spans_enabled(); }
+    void set_wide_spans_enabled(bool enabled)
+    {
+        _span_renderer.set_wide_spans_enabled(enabled);
+        _frame_replay_valid = false;
+    }
+    [[nodiscard]] bool shell_impostor_enabled() const { return _shell_impostor.enabled(); }
+    void set_shell_impostor_enabled(bool enabled)
+    {
+        BN_ASSERT(! enabled || ! affine_floor_enabled(), "Affine floor and shell impostor can't be enabled together");
+        BN_ASSERT(! enabled || ! window_spans_enabled(), "Window spans and shell impostor can't be enabled together");
+        _shell_impostor.set_enabled(enabled && ! STR_BITMAP_RENDERER);
+        _impostor_settled_frames = 0;
+        _frame_replay_valid = false;
+    }
+    [[nodiscard]] Model& create_model(const fr::model_3d_item& model_item,
+                                      const TiledFloorItem* floor_item = nullptr,
+                                      const ModelBounds* bounds = nullptr);
+    [[nodiscard]] Model& create_model(const bn::span<const ModelLod>& lods, const ModelBounds& bounds);
     void destroy_model(Model& model);
     [[nodiscard]] Sprite& create_sprite(SpriteItem& sprite_item);
     void destroy_sprite(Sprite& sprite);
+    [[nodiscard]] BillboardBatch& create_billboard_batch(const bn::sprite_item& item);
+    void destroy_billboard_batch(BillboardBatch& billboard_batch);
     void render(const Camera& camera);
 private:
-    static constexpr int _max_vertices = 240;
-    static constexpr int _max_faces = 192;
-    static_assert(_max_faces <= bn::numeric_limits<uint8_t>::max());
+    static constexpr int _max_vertices = Model::max_vertices;
+    static constexpr int _max_faces = Model::max_faces;
+    static constexpr int _max_edges = Model::max_edges;
+    static constexpr int _max_instanced_vertices = RendererCapacities::max_instanced_vertices;
+    static constexpr int _max_instanced_faces = RendererCapacities::max_instanced_faces;
+    static constexpr int _max_floor_lines = (TiledFloorItem::max_tiles - 1) * 2;
+    static constexpr int _impostor_settle_frames = 8;
+    static constexpr int _max_oam_sprites = RendererCapacities::max_oam_sprites;
+    static constexpr int _billboard_buckets_count = 32;
+    static constexpr int _billboard_bucket_shift = 17;
     struct ScreenPoint { int16_t x; int16_t y; };
     struct PolygonVertex
     {
         int x;
         int y;
+        int next_edge_index;
         PolygonVertex* prev;
         PolygonVertex* next;
     };
-    struct ProjectedFace { const fr::face_3d* face; const ScreenPoint* projected_vertices; int projected_depth; };
+    struct FloorLine
+    {
+        int origin_x;
+        int slope;
+        int16_t origin_y;
+        int8_t direction;
+        int8_t side;
+    };
+    struct ProjectedFloor
+    {
+        const TiledFloorItem* item;
+        int64_t screen_matrix[9];
+        FloorLine lines[_max_floor_lines];
+    };
+    struct ProjectedFace
+    {
+        const fr::face_3d* face;
+        const ScreenPoint* projected_vertices;
+        const uint16_t* edge_indexes;
+        int* edge_deltas;
+        const ProjectedFloor* projected_floor;
+        int projected_depth;
+        RenderLayer layer;
+    };
     struct VisibleRenderItem
     {
         const ProjectedFace* projected_face;
@@ -292,24 +875,63 @@ private:
         int16_t minimum_y;
         int16_t maximum_y;
     };
+    struct ProjectedBillboard
+    {
+        const BillboardBatch* batch;
+        int depth;
+        int16_t x;
+        int16_t y;
+        uint16_t attr0;
+        uint16_t attr1;
+        uint16_t attr2;
+        uint8_t canvas_size;
+        uint8_t frame_tiles_index;
+        uint8_t palette_index;
+        uint8_t affine_mat_index;
+        uint8_t bucket;
+    };
     bn::pool<Model, max_dynamic_models> _models_pool;
     bn::intrusive_list<Model> _models_list;
     uint16_t _models_revision = 0;
     bn::pool<Sprite, max_sprites> _sprites_pool;
     bn::intrusive_list<Sprite> _sprites_list;
+    bn::pool<BillboardBatch, max_billboard_batches> _billboard_batches_pool;
+    bn::intrusive_list<BillboardBatch> _billboard_batches_list;
     VisibleRenderItem _visible_render_items[_max_faces];
-    ScanlineRenderer _scanline_renderer;
+    SpanRenderer _span_renderer;
+    AffineFloorRenderer _affine_floor_renderer;
+    ShellImpostor _shell_impostor;
+    SpriteAffineMatPool _sprite_affine_mats;
+    bn::vector<bn::sprite_ptr, _max_oam_sprites> _oam_sprites;
     int _vertices_count = 0;
     int _faces_count = 0;
+    int _model_faces_count = 0;
     bool _geometry_cache_valid = false;
     fr::point_3d _cached_camera_position;
     bn::fixed _cached_camera_yaw;
     uint16_t _cached_models_revision = 0;
     const Model* _cached_models[max_dynamic_models] = {};
     uint16_t _cached_model_versions[max_dynamic_models] = {};
-    int _cached_models_count = 0;
+    int _cached_model_visible_item_counts[max_dynamic_models] = {};
     int _cached_geometry_visible_item_count = 0;
-    BN_CODE_IWRAM void _render_frame(const Camera& camera);
+    int _sorted_layer_item_counts[render_layers_count] = {};
+    VisibleRenderItem _cached_sprite_render_items[max_sprites];
+    int _cached_sprite_projected_zs[max_sprites] = {};
+    int _cached_sprite_render_items_count = 0;
+    ProjectedBillboard _cached_billboards[max_billboards];
+    int _cached_billboards_count = 0;
+    bool _frame_replay_valid = false;
+    uint8_t _impostor_settled_frames = 0;
+    Model& _add_model(Model& model);
+    [[nodiscard]] BN_CODE_IWRAM bool _render_frame(const Camera& camera);
+    template<typename SpanSink>
+    BN_CODE_IWRAM void _render_floor(SpanSink& span_sink, const ProjectedFloor& projected_floor,
+                                     unsigned minimum_y, unsigned maximum_y, unsigned shading,
+                                     const ScanlineRenderer::ScanlineSpan* scanline_spans);
+    void _set_oam_sprite(int oam_sprite_index, const bn::sprite_shape_size& shape_size,
+                         const bn::sprite_tiles_ptr& tiles, const bn::sprite_palette_ptr& palette,
+                         int affine_mat_index, int x, int y);
+    void _commit_oam_sprites(int oam_sprites_count);
 };
 }
 #endif
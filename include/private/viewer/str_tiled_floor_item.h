@@ -0,0 +1,36 @@
+#ifndef STR_TILED_FLOOR_ITEM_H
+#define STR_TILED_FLOOR_ITEM_H
+#include <cstdint>
+#include "bn_assert.h"
+#include "bn_span.h"
+#include "fr_model_3d_item.h"
+namespace str::viewer
+{
+class TiledFloorItem
+{
+public:
+    static constexpr int max_tiles = 16;
+    constexpr TiledFloorItem(const fr::face_3d& face, int columns, int rows,
+                             const bn::span<const uint8_t>& tile_colors) :
+        _face(face),
+        _tile_colors(tile_colors),
+        _columns(columns),
+        _rows(rows)
+    {
+        BN_ASSERT(! face.triangle(), "Tiled floor face must be a quad");
+        BN_ASSERT(columns > 0 && columns <= max_tiles, "Invalid columns: ", columns);
+        BN_ASSERT(rows > 0 && rows <= max_tiles, "Invalid rows: ", rows);
+        BN_ASSERT(tile_colors.size() == columns * rows, "Invalid tile colors count: ", tile_colors.size());
+    }
+    [[nodiscard]] constexpr const fr::face_3d& face() const { return _face; }
+    [[nodiscard]] constexpr int columns() const { return _columns; }
+    [[nodiscard]] constexpr int rows() const { return _rows; }
+    [[nodiscard]] constexpr int tile_color(int column, int row) const { return _tile_colors[(row * _columns) + column]; }
+private:
+    fr::face_3d _face;
+    bn::span<const uint8_t> _tile_colors;
+    int _columns;
+    int _rows;
+};
+}
+#endif
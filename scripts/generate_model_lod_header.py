@@ -0,0 +1,212 @@
+from __future__ import annotations
+
+import argparse
+import math
+import re
+from dataclasses import dataclass
+from pathlib import Path
+
+from generate_room_shell_header import bounding_sphere
+
+
+@dataclass(frozen=True)
+class LodSpec:
+    cell_radius_divisor: float
+    min_screen_radius: int
+
+
+REPO_ROOT = Path(__file__).resolve().parents[1]
+MODELS_DIR = REPO_ROOT / "include" / "models"
+DEFAULT_OUTPUT_DIR = REPO_ROOT / "build" / "generated" / "include" / "models"
+
+MODEL_NAMES = ["books", "potted_plant"]
+
+FULL_DETAIL_MIN_SCREEN_RADIUS = 8
+LOD_SPECS = [
+    LodSpec(4.0, 4),
+    LodSpec(2.0, 0),
+]
+
+VERTEX_RE = re.compile(r"fr::vertex_3d\(([-\d.]+), ([-\d.]+), ([-\d.]+)\)")
+FACE_RE = re.compile(
+    r"fr::face_3d\(\w+, fr::vertex_3d\(([-\d.]+), ([-\d.]+), ([-\d.]+)\), ([-\d, ]+)\)"
+)
+
+
+@dataclass
+class Mesh:
+    vertices: list[tuple[float, float, float]]
+    faces: list[tuple[tuple[float, float, float], list[int], int, int]]
+
+
+def read_model(name: str) -> Mesh:
+    text = (MODELS_DIR / f"str_model_3d_items_{name}.h").read_text(encoding="utf-8")
+    vertices_text = text.split(f"{name}_vertices[] = {{", 1)[1].split("};", 1)[0]
+    faces_text = text.split(f"{name}_faces[] = {{", 1)[1].split("};", 1)[0]
+    vertices = [tuple(float(value) for value in match) for match in VERTEX_RE.findall(vertices_text)]
+    faces = []
+    for nx, ny, nz, values in FACE_RE.findall(faces_text):
+        numbers = [int(value) for value in values.split(",")]
+        faces.append(((float(nx), float(ny), float(nz)), numbers[:-2], numbers[-2], numbers[-1]))
+    return Mesh(vertices, faces)
+
+
+def subtract(a, b):
+    return (a[0] - b[0], a[1] - b[1], a[2] - b[2])
+
+
+def cross(a, b):
+    return (a[1] * b[2] - a[2] * b[1], a[2] * b[0] - a[0] * b[2], a[0] * b[1] - a[1] * b[0])
+
+
+def dot(a, b):
+    return a[0] * b[0] + a[1] * b[1] + a[2] * b[2]
+
+
+def polygon_normal(points: list[tuple[float, float, float]]) -> tuple[float, float, float]:
+    normal = (0.0, 0.0, 0.0)
+    for index, point in enumerate(points):
+        next_point = points[(index + 1) % len(points)]
+        normal = (
+            normal[0] + (point[1] - next_point[1]) * (point[2] + next_point[2]),
+            normal[1] + (point[2] - next_point[2]) * (point[0] + next_point[0]),
+            normal[2] + (point[0] - next_point[0]) * (point[1] + next_point[1]),
+        )
+    length = math.sqrt(dot(normal, normal))
+    if length < 1e-6:
+        return (0.0, 0.0, 0.0)
+    return (normal[0] / length, normal[1] / length, normal[2] / length)
+
+
+def convex(points: list[tuple[float, float, float]], normal: tuple[float, float, float]) -> bool:
+    for index, point in enumerate(points):
+        edge = subtract(points[(index + 1) % len(points)], point)
+        next_edge = subtract(points[(index + 2) % len(points)], points[(index + 1) % len(points)])
+        if dot(cross(edge, next_edge), normal) <= 0:
+            return False
+    return True
+
+
+def simplify(mesh: Mesh, cell_size: float) -> Mesh:
+    minimum = tuple(min(vertex[axis] for vertex in mesh.vertices) for axis in range(3))
+    cells: dict[tuple[int, int, int], list[int]] = {}
+    vertex_cells = []
+    for index, vertex in enumerate(mesh.vertices):
+        key = tuple(int((vertex[axis] - minimum[axis]) // cell_size) for axis in range(3))
+        cells.setdefault(key, []).append(index)
+        vertex_cells.append(key)
+    cell_points = {
+        key: tuple(sum(mesh.vertices[index][axis] for index in indexes) / len(indexes) for axis in range(3))
+        for key, indexes in cells.items()
+    }
+
+    vertices: list[tuple[float, float, float]] = []
+    vertex_ids: dict[tuple[int, int, int], int] = {}
+    faces = []
+    face_keys = set()
+
+    def add_vertex(key):
+        index = vertex_ids.get(key)
+        if index is None:
+            index = len(vertices)
+            vertex_ids[key] = index
+            vertices.append(cell_points[key])
+        return index
+
+    def add_face(keys, original_normal, color, shading):
+        points = [cell_points[key] for key in keys]
+        normal = polygon_normal(points)
+        if dot(normal, original_normal) <= 0:
+            return
+        face_key = tuple(sorted(keys))
+        if face_key in face_keys:
+            return
+        face_keys.add(face_key)
+        faces.append((normal, [add_vertex(key) for key in keys], color, shading))
+
+    for original_normal, indexes, color, shading in mesh.faces:
+        keys = []
+        for index in indexes:
+            key = vertex_cells[index]
+            if key not in keys:
+                keys.append(key)
+        if len(keys) < 3:
+            continue
+        if len(keys) == 4 and not convex([cell_points[key] for key in keys], original_normal):
+            add_face(keys[:3], original_normal, color, shading)
+            add_face([keys[0], keys[2], keys[3]], original_normal, color, shading)
+        else:
+            add_face(keys, original_normal, color, shading)
+
+    return Mesh(vertices, faces)
+
+
+def point_to_string(point: tuple[float, float, float]) -> str:
+    x, y, z = (round(value, 6) + 0.0 for value in point)
+    return f"fr::vertex_3d({x:.6f}, {y:.6f}, {z:.6f})"
+
+
+def write_model(lines: list[str], name: str, mesh: Mesh):
+    lines.append(f"    constexpr inline fr::vertex_3d {name}_vertices[] = {{")
+    for index, vertex in enumerate(mesh.vertices):
+        comma = "," if index < len(mesh.vertices) - 1 else ""
+        lines.append(f"        {point_to_string(vertex)}{comma}  // {index}")
+    lines.append("    };")
+    lines.append(f"    constexpr inline fr::face_3d {name}_faces[] = {{")
+    for index, (normal, indexes, color, shading) in enumerate(mesh.faces):
+        comma = "," if index < len(mesh.faces) - 1 else ""
+        face_indexes = ", ".join(str(face_index) for face_index in indexes)
+        lines.append(
+            f"        fr::face_3d({name}_vertices, {point_to_string(normal)}, {face_indexes}, "
+            f"{color}, {shading}){comma}"
+        )
+    lines.append("    };")
+    lines.append(f"    constexpr inline fr::model_3d_item {name}({name}_vertices, {name}_faces);")
+
+
+def write_header(output_dir: Path, name: str):
+    mesh = read_model(name)
+    (cx, cy, cz), radius = bounding_sphere(mesh.vertices)
+    guard = f"STR_MODEL_3D_ITEMS_{name.upper()}_LODS_H"
+    lines = []
+    lines.append(f"#ifndef {guard}")
+    lines.append(f"#define {guard}")
+    lines.append("")
+    lines.append(f'#include "models/str_model_3d_items_{name}.h"')
+    lines.append('#include "private/viewer/str_model_bounds.h"')
+    lines.append('#include "private/viewer/str_model_lod.h"')
+    lines.append("")
+    lines.append("namespace str::model_3d_items")
+    lines.append("{")
+    lines.append(
+        f"    constexpr inline str::viewer::ModelBounds {name}_bounds("
+        f"fr::point_3d({cx:.1f}, {cy:.1f}, {cz:.1f}), {radius:.1f});"
+    )
+    lines.append("")
+    lod_entries = [f"str::viewer::ModelLod({name}, {FULL_DETAIL_MIN_SCREEN_RADIUS})"]
+    for lod_index, spec in enumerate(LOD_SPECS, start=1):
+        lod_name = f"{name}_lod_{lod_index}"
+        write_model(lines, lod_name, simplify(mesh, radius / spec.cell_radius_divisor))
+        lines.append("")
+        lod_entries.append(f"str::viewer::ModelLod({lod_name}, {spec.min_screen_radius})")
+    lines.append(f"    constexpr inline str::viewer::ModelLod {name}_lods[] = {{")
+    for index, entry in enumerate(lod_entries):
+        comma = "," if index < len(lod_entries) - 1 else ""
+        lines.append(f"        {entry}{comma}")
+    lines.append("    };")
+    lines.append("}")
+    lines.append("")
+    lines.append("#endif")
+    lines.append("")
+
+    output_path = output_dir / f"str_model_3d_items_{name}_lods.h"
+    output_path.parent.mkdir(parents=True, exist_ok=True)
+    output_path.write_text("\n".join(lines), encoding="utf-8")
+
+
+if __name__ == "__main__":
+    parser = argparse.ArgumentParser()
+    parser.add_argument("--output-dir", type=Path, default=DEFAULT_OUTPUT_DIR)
+    args = parser.parse_args()
+    for model_name in MODEL_NAMES:
+        write_header(args.output_dir, model_name)
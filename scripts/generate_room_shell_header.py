@@ -1,6 +1,7 @@
 from __future__ import annotations
 
 import argparse
+import math
 from dataclasses import dataclass
 from pathlib import Path
 
@@ -49,6 +50,7 @@ class MeshBuilder:
         self.vertices: list[tuple[float, float, float]] = []
         self.vertex_ids: dict[tuple[float, float, float], int] = {}
         self.faces: list[tuple[str, int, int, int, int, int]] = []
+        self.floor: tuple[int, int, int, int, int, int, list[int]] | None = None
 
     def add_vertex(self, x: float, y: float, z: float) -> int:
         key = (round(x, 4), round(y, 4), round(z, 4))
@@ -66,12 +68,25 @@ class MeshBuilder:
         i3 = self.add_vertex(*p3)
         self.faces.append((normal_to_string(normal), i0, i1, i2, i3, color))
 
+    def set_tiled_floor(self, p0, p1, p2, p3, columns: int, rows: int, tile_colors: list[int]):
+        i0 = self.add_vertex(*p0)
+        i1 = self.add_vertex(*p1)
+        i2 = self.add_vertex(*p2)
+        i3 = self.add_vertex(*p3)
+        self.floor = (i0, i1, i2, i3, columns, rows, tile_colors)
+
 
 def normal_to_string(normal: tuple[float, float, float]) -> str:
     x, y, z = normal
     return f"fr::vertex_3d({x:.1f}, {y:.1f}, {z:.1f})"
 
 
+def bounding_sphere(vertices: list[tuple[float, float, float]]) -> tuple[tuple[float, float, float], float]:
+    center = tuple(round((min(v[axis] for v in vertices) + max(v[axis] for v in vertices)) / 2, 1) for axis in range(3))
+    radius = max(math.dist(center, v) for v in vertices)
+    return center, math.ceil(radius * 10) / 10
+
+
 def interval_segments(bounds: float, openings: list[tuple[float, float]]) -> list[tuple[float, float]]:
     positions = [-bounds]
     for start, end in sorted(openings):
@@ -128,25 +143,16 @@ def build_room(spec: RoomSpec) -> MeshBuilder:
     wainscot_top = -14.0
     openings_by_side = room_openings(spec)
     floor_tiles = 7 if spec.half_w <= 60.0 else 8
-    tile_w = (spec.half_w * 2.0) / floor_tiles
-    tile_d = (spec.half_d * 2.0) / floor_tiles
-
-    for row in range(floor_tiles):
-        y0 = spec.half_d - row * tile_d
-        y1 = y0 - tile_d
-
-        for col in range(floor_tiles):
-            x0 = -spec.half_w + col * tile_w
-            x1 = x0 + tile_w
-            floor_color = (row * 2 + col * 3) % 6
-            mesh.add_quad(
-                (x0, y0, 0.0),
-                (x1, y0, 0.0),
-                (x1, y1, 0.0),
-                (x0, y1, 0.0),
-                floor_color,
-                (0.0, 0.0, -1.0),
-            )
+    floor_colors = [(row * 2 + col * 3) % 6 for row in range(floor_tiles) for col in range(floor_tiles)]
+    mesh.set_tiled_floor(
+        (-spec.half_w, spec.half_d, 0.0),
+        (spec.half_w, spec.half_d, 0.0),
+        (spec.half_w, -spec.half_d, 0.0),
+        (-spec.half_w, -spec.half_d, 0.0),
+        floor_tiles,
+        floor_tiles,
+        floor_colors,
+    )
 
     def add_wall_quad(start: float, end: float, z_bottom: float, z_top: float, color: int,
                       axis: str, side: float, normal: tuple[float, float, float]):
@@ -211,6 +217,8 @@ def write_header(output_path: Path):
     lines.append("")
     lines.append('#include "fr_model_3d_item.h"')
     lines.append('#include "bn_color.h"')
+    lines.append('#include "private/viewer/str_model_bounds.h"')
+    lines.append('#include "private/viewer/str_tiled_floor_item.h"')
     lines.append("")
     lines.append("namespace str::model_3d_items")
     lines.append("{")
@@ -237,6 +245,27 @@ def write_header(output_path: Path):
             )
         lines.append("    };")
         lines.append(f"    constexpr inline fr::model_3d_item {room.name}({room.name}_vertices, {room.name}_faces);")
+        (cx, cy, cz), radius = bounding_sphere(mesh.vertices)
+        lines.append(
+            f"    constexpr inline str::viewer::ModelBounds {room.name}_bounds("
+            f"fr::point_3d({cx:.1f}, {cy:.1f}, {cz:.1f}), {radius:.1f});"
+        )
+        lines.append("")
+        i0, i1, i2, i3, columns, rows, tile_colors = mesh.floor
+        lines.append(f"    constexpr inline uint8_t {room.name}_floor_tile_colors[] = {{")
+        for row in range(rows):
+            comma = "," if row < rows - 1 else ""
+            row_colors = ", ".join(str(color) for color in tile_colors[row * columns:(row + 1) * columns])
+            lines.append(f"        {row_colors}{comma}")
+        lines.append("    };")
+        lines.append(
+            f"    constexpr inline fr::face_3d {room.name}_floor_face("
+            f"{room.name}_vertices, {normal_to_string((0.0, 0.0, -1.0))}, {i0}, {i1}, {i2}, {i3}, {tile_colors[0]}, -1);"
+        )
+        lines.append(
+            f"    constexpr inline str::viewer::TiledFloorItem {room.name}_floor("
+            f"{room.name}_floor_face, {columns}, {rows}, {room.name}_floor_tile_colors);"
+        )
         lines.append("")
 
     lines.append("    constexpr inline fr::model_3d_item room(room_0_vertices, room_0_faces);")
@@ -0,0 +1,226 @@
+from __future__ import annotations
+
+import argparse
+import math
+import random
+import sys
+from dataclasses import dataclass
+
+from generate_room_shell_header import ROOM_SPECS, build_room
+
+FIXED_PRECISION = 12
+FIXED_ONE = 1 << FIXED_PRECISION
+MODEL_VIEW_MATRIX_BITS = 24
+MODEL_VIEW_SCREEN_SHIFT = MODEL_VIEW_MATRIX_BITS + 4
+FOCAL_LENGTH_SHIFT = 8
+DIV_LUT_PRECISION = 24
+DIV_LUT_MAX_INDEX = 1024 * 4 - 1
+NEAR_PLANE = 24 * 256 * 16
+DISPLAY_WIDTH = 240
+DISPLAY_HEIGHT = 160
+
+
+@dataclass
+class Stats:
+    compared: int = 0
+    differing: int = 0
+    max_error: int = 0
+    validity_mismatches: int = 0
+
+    def add(self, other: Stats):
+        self.compared += other.compared
+        self.differing += other.differing
+        self.max_error = max(self.max_error, other.max_error)
+        self.validity_mismatches += other.validity_mismatches
+
+
+@dataclass(frozen=True)
+class Scene:
+    rotation: tuple[tuple[int, int, int], ...]
+    scale: int
+    position: tuple[int, int, int]
+    camera: tuple[int, int, int]
+    right_axis: tuple[int, int]
+    up_axis: tuple[int, int]
+
+
+def wrap32(value: int) -> int:
+    return ((value + (1 << 31)) % (1 << 32)) - (1 << 31)
+
+
+def to_fixed(value: float) -> int:
+    return int(value * FIXED_ONE)
+
+
+def unsafe_multiplication(a: int, b: int) -> int:
+    return wrap32(a * b) >> FIXED_PRECISION
+
+
+def safe_multiplication(a: int, b: int) -> int:
+    return wrap32((a * b) >> FIXED_PRECISION)
+
+
+def truncated_division(a: int, b: int) -> int:
+    quotient = abs(a) // abs(b)
+    return quotient if (a >= 0) == (b > 0) else -quotient
+
+
+def depth_scale(camera_depth: int) -> int:
+    index = camera_depth >> 10
+    div_lut_value = (1 << DIV_LUT_PRECISION) // index if index else 0
+    return (div_lut_value << (FOCAL_LENGTH_SHIFT - 8)) >> 6
+
+
+def visible_depth(camera_depth: int) -> bool:
+    return camera_depth >= NEAR_PLANE and (camera_depth >> 10) <= DIV_LUT_MAX_INDEX
+
+
+def screen_point(projected_x: int, projected_y: int, camera_depth: int) -> tuple[int, int]:
+    scale = depth_scale(camera_depth)
+    return (
+        (wrap32(projected_x * scale) >> 16) + (DISPLAY_WIDTH // 2),
+        (wrap32(projected_y * scale) >> 16) + (DISPLAY_HEIGHT // 2),
+    )
+
+
+def project_transformed(scene: Scene, vertex: tuple[int, int, int]) -> tuple[int, int] | None:
+    vx, vy, vz = vertex
+    vxy = safe_multiplication(vx, vy)
+    rotated = []
+    for row in scene.rotation:
+        row_x, row_y, row_z = row
+        value = (safe_multiplication(row_x + vy, row_y + vx) + unsafe_multiplication(vz, row_z) -
+                 unsafe_multiplication(row_x, row_y) - vxy)
+        if scene.scale != FIXED_ONE:
+            value = unsafe_multiplication(value, scene.scale)
+        rotated.append(value)
+    world = [rotated[axis] + scene.position[axis] for axis in range(3)]
+    camera_depth = -(world[1] - scene.camera[1])
+    if not visible_depth(camera_depth):
+        return None
+    view_x = truncated_division(world[0] - scene.camera[0], 16)
+    view_z = truncated_division(world[2] - scene.camera[2], 16)
+    u_x, u_z = scene.right_axis
+    v_x, v_z = scene.up_axis
+    projected_x = unsafe_multiplication(view_x, u_x) + unsafe_multiplication(view_z, u_z)
+    projected_y = -(unsafe_multiplication(view_x, v_x) + unsafe_multiplication(view_z, v_z))
+    return screen_point(projected_x, projected_y, camera_depth)
+
+
+def build_model_view_matrix(scene: Scene) -> tuple[list[list[int]], list[int]]:
+    x_axis, y_axis, z_axis = scene.rotation
+    u_x, u_z = scene.right_axis
+    v_x, v_z = scene.up_axis
+    rows = [[0] * 3 for _ in range(3)]
+    for column in range(3):
+        projected_x = (x_axis[column] * u_x) + (z_axis[column] * u_z)
+        projected_y = -((x_axis[column] * v_x) + (z_axis[column] * v_z))
+        rows[0][column] = wrap32((projected_x * scene.scale) >> 12)
+        rows[1][column] = wrap32((projected_y * scene.scale) >> 12)
+        rows[2][column] = wrap32(-(y_axis[column] * scene.scale))
+    view_x = scene.position[0] - scene.camera[0]
+    view_y = scene.position[1] - scene.camera[1]
+    view_z = scene.position[2] - scene.camera[2]
+    translations = [
+        ((view_x * u_x) + (view_z * u_z)) << 12,
+        -(((view_x * v_x) + (view_z * v_z)) << 12),
+        -(view_y << MODEL_VIEW_MATRIX_BITS),
+    ]
+    return rows, translations
+
+
+def project_model_view(rows: list[list[int]], translations: list[int],
+                       vertex: tuple[int, int, int]) -> tuple[int, int] | None:
+    def dot(row: int) -> int:
+        row_values = rows[row]
+        return (row_values[0] * vertex[0]) + (row_values[1] * vertex[1]) + (row_values[2] * vertex[2]) + \
+            translations[row]
+
+    camera_depth = wrap32(dot(2) >> MODEL_VIEW_MATRIX_BITS)
+    if not visible_depth(camera_depth):
+        return None
+    projected_x = wrap32(dot(0) >> MODEL_VIEW_SCREEN_SHIFT)
+    projected_y = wrap32(dot(1) >> MODEL_VIEW_SCREEN_SHIFT)
+    return screen_point(projected_x, projected_y, camera_depth)
+
+
+def random_rotation(rng: random.Random) -> tuple[tuple[int, int, int], ...]:
+    a, b, c = (rng.uniform(-math.pi, math.pi) for _ in range(3))
+    ca, sa, cb, sb, cc, sc = math.cos(a), math.sin(a), math.cos(b), math.sin(b), math.cos(c), math.sin(c)
+    matrix = (
+        (ca * cb, ca * sb * sc - sa * cc, ca * sb * cc + sa * sc),
+        (sa * cb, sa * sb * sc + ca * cc, sa * sb * cc - ca * sc),
+        (-sb, cb * sc, cb * cc),
+    )
+    return tuple(tuple(to_fixed(value) for value in row) for row in matrix)
+
+
+def random_scene(rng: random.Random, scale: float) -> Scene:
+    yaw = rng.randrange(0x10000) * 2 * math.pi / 0x10000
+    sin_yaw = to_fixed(math.sin(yaw))
+    cos_yaw = to_fixed(math.cos(yaw))
+    return Scene(
+        rotation=random_rotation(rng),
+        scale=to_fixed(scale),
+        position=(to_fixed(rng.uniform(-150, 150)), to_fixed(rng.uniform(-20, 20)), to_fixed(rng.uniform(-150, 150))),
+        camera=(to_fixed(rng.uniform(-40, 40)), to_fixed(rng.uniform(100, 500)), to_fixed(rng.uniform(-40, 40))),
+        right_axis=(cos_yaw, sin_yaw),
+        up_axis=(sin_yaw, -cos_yaw),
+    )
+
+
+def compare_room(vertices: list[tuple[int, int, int]], scenes: list[Scene]) -> Stats:
+    stats = Stats()
+    for scene in scenes:
+        rows, translations = build_model_view_matrix(scene)
+        for vertex in vertices:
+            transformed = project_transformed(scene, vertex)
+            model_view = project_model_view(rows, translations, vertex)
+            if (transformed is None) != (model_view is None):
+                stats.validity_mismatches += 1
+                continue
+            if transformed is None:
+                continue
+            x, y = transformed
+            if x < 0 or x >= DISPLAY_WIDTH or y < 0 or y >= DISPLAY_HEIGHT:
+                continue
+            error = max(abs(x - model_view[0]), abs(y - model_view[1]))
+            stats.compared += 1
+            stats.differing += error > 0
+            stats.max_error = max(stats.max_error, error)
+    return stats
+
+
+def format_stats(name: str, stats: Stats) -> str:
+    differing = (100.0 * stats.differing / stats.compared) if stats.compared else 0.0
+    return (f"{name}: {stats.compared} on-screen vertices, {differing:.2f}% differ, "
+            f"max error {stats.max_error} px, {stats.validity_mismatches} validity mismatches")
+
+
+def main() -> int:
+    parser = argparse.ArgumentParser(
+        description="Compare Model::transform projection against the model-view matrix path on room shells.",
+    )
+    parser.add_argument("--scenes", type=int, default=4000, help="Random scenes per room (default: 4000).")
+    parser.add_argument("--seed", type=int, default=1, help="Random seed (default: 1).")
+    parser.add_argument("--scale", type=float, default=1.0, help="Model scale (default: 1).")
+    parser.add_argument("--max-error", type=int, default=1, help="Allowed error in pixels (default: 1).")
+    args = parser.parse_args()
+
+    rng = random.Random(args.seed)
+    total = Stats()
+    for spec in ROOM_SPECS:
+        mesh = build_room(spec)
+        vertices = [tuple(to_fixed(value) for value in vertex) for vertex in mesh.vertices]
+        scenes = [random_scene(rng, args.scale) for _ in range(args.scenes)]
+        stats = compare_room(vertices, scenes)
+        print(format_stats(spec.name, stats))
+        total.add(stats)
+    print(format_stats("total", total))
+    ok = total.max_error <= args.max_error and not total.validity_mismatches
+    print("OK" if ok else "FAIL")
+    return 0 if ok else 1
+
+
+if __name__ == "__main__":
+    sys.exit(main())
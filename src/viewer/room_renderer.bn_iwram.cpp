@@ -1,4 +1,5 @@
 #include "private/viewer/str_room_renderer.h"
+#include "bn_memory.h"
 #include "bn_profiler.h"
 #include "../../butano/butano/hw/include/bn_hw_sprites.h"
 #include "fr_div_lut.h"
@@ -15,18 +16,217 @@
         { \
         } while(false)
 #endif
+#ifndef STR_SCANLINE_ASM_KERNEL
+    #define STR_SCANLINE_ASM_KERNEL true
+#endif
 namespace str::viewer
 {
 namespace
 {
+    struct ScanlineSpanKernelArgs
+    {
+        const ScanlineRenderer::ScanlineSpan* spans;
+        uint16_t* hdma_source;
+        uint8_t* sprite_counts;
+        uint16_t* slots;
+        uint32_t* last_spans;
+        int lines_count;
+        int y;
+        int attr0;
+        int attr1;
+        int attr2;
+        int last_span_attributes;
+        int last_span_key;
+        int merge_key;
+        int max_slots;
+        int hdma_line_stride;
+        int slots_line_stride;
+        int last_span_stride;
+    };
+    struct ModelViewMatrix
+    {
+        int rows[3][3];
+        int64_t translations[3];
+    };
+    struct RotatedPoint
+    {
+        int64_t values[3];
+    };
+    enum class FaceRenderRule : uint8_t
+    {
+        never,
+        front_facing,
+        always
+    };
+    struct ClassifiedFace
+    {
+        int centroid_view_y;
+        FaceRenderRule render_rule;
+        RenderLayer layer;
+    };
+    struct FloorLineEvent
+    {
+        int16_t x;
+        int8_t column_delta;
+        int8_t row_delta;
+    };
     constexpr int fixed_precision = 18;
     using fixed = bn::fixed_t<fixed_precision>;
     constexpr int split_length = 64 - 2;
-    constexpr int room_back_layer_bias = 1000000;
-    constexpr int room_front_layer_bias = -1000000;
+    constexpr int wide_split_length = 128 - 1;
     constexpr bn::fixed room_near_wall_cull_normal_y_max = bn::fixed(-0.2);
     constexpr int projected_face_min_area2 = 8;
     constexpr int div_lut_max_index = 1024 * 4 - 1;
+    constexpr int model_bounds_margin = 64;
+    constexpr int model_lod_hysteresis = 1;
+    constexpr int model_view_matrix_bits = 24;
+    constexpr int model_view_screen_shift = model_view_matrix_bits + 4;
+    constexpr int temporal_sort_max_shifts_per_item = 2;
+    constexpr int invalid_edge_delta = bn::numeric_limits<int>::min();
+    constexpr int affine_floor_matrix_bits = 24;
+    constexpr int affine_floor_hidden_position = -(8 << 8);
+    using face_index_type = RendererCapacities::face_index_type;
+    extern "C" int str_scanline_emit_spans(const ScanlineSpanKernelArgs* args);
+    void normalize_projective_matrix(int64_t* matrix)
+    {
+        uint64_t maximum = 0;
+        for(int index = 0; index < 9; ++index)
+        {
+            maximum |= uint64_t(matrix[index] < 0 ? -matrix[index] : matrix[index]);
+        }
+        int shift = (64 - __builtin_clzll(maximum)) - affine_floor_matrix_bits;
+        if(shift > 0)
+        {
+            for(int index = 0; index < 9; ++index)
+            {
+                matrix[index] >>= shift;
+            }
+        }
+    }
+    void write_affine_floor_line(uint16_t* line, int pa, int pc, int x, int y)
+    {
+        line[0] = uint16_t(pa);
+        line[1] = 0;
+        line[2] = uint16_t(pc);
+        line[3] = 0;
+        line[4] = uint16_t(x);
+        line[5] = uint16_t(x >> 16);
+        line[6] = uint16_t(y);
+        line[7] = uint16_t(y >> 16);
+    }
+    [[nodiscard]] bool temporal_insertion_sort(face_index_type* indexes, int count, const int* projected_zs, int max_shifts)
+    {
+        int shifts = 0;
+        for(int sorted_count = 1; sorted_count < count; ++sorted_count)
+        {
+            face_index_type index = indexes[sorted_count];
+            int z = projected_zs[index];
+            int insert_index = sorted_count;
+            while(insert_index > 0)
+            {
+                face_index_type previous_index = indexes[insert_index - 1];
+                int previous_z = projected_zs[previous_index];
+                if(previous_z > z || (previous_z == z && previous_index < index))
+                {
+                    break;
+                }
+                indexes[insert_index] = previous_index;
+                --insert_index;
+            }
+            indexes[insert_index] = index;
+            shifts += sorted_count - insert_index;
+            if(shifts > max_shifts)
+            {
+                return false;
+            }
+        }
+        return true;
+    }
+    void radix_sort(const face_index_type* input_indexes, face_index_type* output_indexes, face_index_type* temp_indexes, int count,
+                    const int* projected_zs)
+    {
+        int maximum_z = projected_zs[input_indexes[0]];
+        int minimum_z = maximum_z;
+        for(int index = 1; index < count; ++index)
+        {
+            int z = projected_zs[input_indexes[index]];
+            if(z > maximum_z)
+            {
+                maximum_z = z;
+            }
+            else if(z < minimum_z)
+            {
+                minimum_z = z;
+            }
+        }
+        unsigned range = unsigned(maximum_z - minimum_z);
+        int passes = 1;
+        while(passes < 4 && (range >> (passes * 8)))
+        {
+            ++passes;
+        }
+        const face_index_type* source_indexes = input_indexes;
+        face_index_type* destination_indexes = passes % 2 ? output_indexes : temp_indexes;
+        for(int pass = 0; pass < passes; ++pass)
+        {
+            int shift = pass * 8;
+            int bucket_offsets[256] = {};
+            for(int index = 0; index < count; ++index)
+            {
+                unsigned key = unsigned(maximum_z - projected_zs[source_indexes[index]]);
+                ++bucket_offsets[(key >> shift) & 255];
+            }
+            int offset = 0;
+            for(int& bucket_offset : bucket_offsets)
+            {
+                int bucket_count = bucket_offset;
+                bucket_offset = offset;
+                offset += bucket_count;
+            }
+            for(int index = 0; index < count; ++index)
+            {
+                face_index_type face_index = source_indexes[index];
+                unsigned key = unsigned(maximum_z - projected_zs[face_index]);
+                destination_indexes[bucket_offsets[(key >> shift) & 255]++] = face_index;
+            }
+            source_indexes = destination_indexes;
+            destination_indexes = destination_indexes == output_indexes ? temp_indexes : output_indexes;
+        }
+    }
+    void temporal_depth_sort(const face_index_type* previous_indexes, int previous_count, const face_index_type* unsorted_indexes,
+                             face_index_type* sorted_indexes, face_index_type* temp_indexes, bool* pending_indexes, int count,
+                             const int* projected_zs)
+    {
+        for(int index = 0; index < count; ++index)
+        {
+            pending_indexes[unsorted_indexes[index]] = true;
+        }
+        int sorted_count = 0;
+        for(int index = 0; index < previous_count; ++index)
+        {
+            face_index_type face_index = previous_indexes[index];
+            if(pending_indexes[face_index])
+            {
+                pending_indexes[face_index] = false;
+                sorted_indexes[sorted_count] = face_index;
+                ++sorted_count;
+            }
+        }
+        for(int index = 0; index < count; ++index)
+        {
+            face_index_type face_index = unsorted_indexes[index];
+            if(pending_indexes[face_index])
+            {
+                pending_indexes[face_index] = false;
+                sorted_indexes[sorted_count] = face_index;
+                ++sorted_count;
+            }
+        }
+        if(! temporal_insertion_sort(sorted_indexes, count, projected_zs, count * temporal_sort_max_shifts_per_item))
+        {
+            radix_sort(unsorted_indexes, sorted_indexes, temp_indexes, count, projected_zs);
+        }
+    }
 }
 auto ScanlineRenderer::_scanline_sprite_attributes(int width, int color_index, unsigned shading) const
         -> ScanlineSpriteAttributes
@@ -39,7 +239,8 @@ auto ScanlineRenderer::_scanline_sprite_attributes(int width, int color_index, u
             bn::hw::sprites::second_attributes(0, bn::sprite_size::SMALL, false, false),
             bn::hw::sprites::third_attributes(tile_ids.small_tiles_id, palette_id, 3),
             1,
-            bn::display::width()
+            bn::display::width(),
+            6
         };
     }
     if(width < 16)
@@ -48,7 +249,8 @@ auto ScanlineRenderer::_scanline_sprite_attributes(int width, int color_index, u
             bn::hw::sprites::second_attributes(0, bn::sprite_size::NORMAL, false, false),
             bn::hw::sprites::third_attributes(tile_ids.normal_tiles_id, palette_id, 3),
             1,
-            bn::display::width()
+            bn::display::width(),
+            14
         };
     }
     if(width < 32)
@@ -57,16 +259,30 @@ auto ScanlineRenderer::_scanline_sprite_attributes(int width, int color_index, u
             bn::hw::sprites::second_attributes(0, bn::sprite_size::BIG, false, false),
             bn::hw::sprites::third_attributes(tile_ids.big_tiles_id, palette_id, 3),
             1,
-            bn::display::width()
+            bn::display::width(),
+            30
         };
     }
     int clipped_width = bn::min(width, bn::display::width());
+    if(_wide_spans_enabled && width > split_length + 1)
+    {
+        int segment_count = 1 + ((clipped_width - 1) / wide_split_length);
+        return {
+            bn::hw::sprites::second_attributes(0, bn::sprite_size::HUGE, false, false),
+            bn::hw::sprites::third_attributes(tile_ids.huge_tiles_id, palette_id, 3),
+            segment_count,
+            segment_count > 1 ? (clipped_width + segment_count - 2) / segment_count : bn::display::width(),
+            split_length,
+            true
+        };
+    }
     int segment_count = width > split_length ? 1 + ((clipped_width - 1) / split_length) : 1;
     return {
         bn::hw::sprites::second_attributes(0, bn::sprite_size::HUGE, false, false),
         bn::hw::sprites::third_attributes(tile_ids.huge_tiles_id, palette_id, 3),
         segment_count,
-        segment_count > 1 ? split_length : bn::display::width()
+        segment_count > 1 ? split_length : bn::display::width(),
+        split_length
     };
 }
 bool ScanlineRenderer::_clip_span_to_screen(int& left_x, int& right_x) const
@@ -85,14 +301,303 @@ bool ScanlineRenderer::_clip_span_to_screen(int& left_x, int& right_x) const
     }
     return true;
 }
-bool ScanlineRenderer::_reserve_scanline_slots(unsigned y, int slot_count, uint16_t*& sprite_hdma_source)
+bool ScanlineRenderer::covered(int minimum_y, int maximum_y, int minimum_x, int maximum_x) const
 {
-    int used_slots = _scanline_sprite_counts[y];
-    if(used_slots + slot_count > _max_hdma_sprites)
+    for(int y = minimum_y; y <= maximum_y; ++y)
+    {
+        const CoverageInterval* intervals = _coverage_intervals[y];
+        int intervals_count = _coverage_interval_counts[y];
+        bool line_covered = false;
+        for(int index = 0; index < intervals_count; ++index)
+        {
+            if(intervals[index].left_x <= minimum_x && intervals[index].right_x >= maximum_x)
+            {
+                line_covered = true;
+                break;
+            }
+        }
+        if(! line_covered)
+        {
+            return false;
+        }
+    }
+    return true;
+}
+bool ScanlineRenderer::_coverage_overlaps(
+        unsigned minimum_y, unsigned maximum_y, const ScanlineSpan* scanline_spans) const
+{
+    for(unsigned y = minimum_y; y <= maximum_y; ++y)
+    {
+        const CoverageInterval* intervals = _coverage_intervals[y];
+        int intervals_count = _coverage_interval_counts[y];
+        int left_x = scanline_spans[y].left_x;
+        int right_x = scanline_spans[y].right_x;
+        for(int index = 0; index < intervals_count; ++index)
+        {
+            if(intervals[index].left_x <= right_x && intervals[index].right_x >= left_x)
+            {
+                return true;
+            }
+        }
+#if STR_WINDOW_SPANS
+        const WindowSpan* window_spans = _window_spans[y];
+        for(int index = 0, window_spans_count = _window_span_counts[y]; index < window_spans_count; ++index)
+        {
+            if(window_spans[index].left_x <= right_x && window_spans[index].right_x >= left_x)
+            {
+                return true;
+            }
+        }
+#endif
+    }
+    return false;
+}
+bool ScanlineRenderer::_trim_covered_span(unsigned y, int& left_x, int& right_x) const
+{
+    const CoverageInterval* intervals = _coverage_intervals[y];
+    int intervals_count = _coverage_interval_counts[y];
+    for(int index = 0; index < intervals_count; ++index)
+    {
+        int interval_left_x = intervals[index].left_x;
+        int interval_right_x = intervals[index].right_x;
+        if(interval_left_x <= left_x && interval_right_x >= left_x)
+        {
+            left_x = interval_right_x + 1;
+        }
+        if(interval_left_x <= right_x && interval_right_x >= right_x)
+        {
+            right_x = interval_left_x - 1;
+        }
+    }
+    return left_x <= right_x;
+}
+void ScanlineRenderer::_add_covered_span(unsigned y, int left_x, int right_x)
+{
+    CoverageInterval* intervals = _coverage_intervals[y];
+    int intervals_count = _coverage_interval_counts[y];
+    int first_index = 0;
+    while(first_index < intervals_count && intervals[first_index].right_x + 1 < left_x)
+    {
+        ++first_index;
+    }
+    int last_index = first_index;
+    while(last_index < intervals_count && intervals[last_index].left_x <= right_x + 1)
+    {
+        left_x = bn::min(left_x, int(intervals[last_index].left_x));
+        right_x = bn::max(right_x, int(intervals[last_index].right_x));
+        ++last_index;
+    }
+    int merged_count = last_index - first_index;
+    if(! merged_count)
+    {
+        if(intervals_count == _max_coverage_intervals)
+        {
+            return;
+        }
+        for(int index = intervals_count; index > first_index; --index)
+        {
+            intervals[index] = intervals[index - 1];
+        }
+        ++intervals_count;
+    }
+    else
+    {
+        for(int index = last_index; index < intervals_count; ++index)
+        {
+            intervals[index - merged_count + 1] = intervals[index];
+        }
+        intervals_count -= merged_count - 1;
+    }
+    intervals[first_index] = { int16_t(left_x), int16_t(right_x) };
+    _coverage_interval_counts[y] = uint8_t(intervals_count);
+}
+void ScanlineRenderer::_remove_covered_span(unsigned y, int left_x, int right_x)
+{
+    CoverageInterval* intervals = _coverage_intervals[y];
+    int intervals_count = _coverage_interval_counts[y];
+    int index = 0;
+    while(index < intervals_count)
+    {
+        int interval_left_x = intervals[index].left_x;
+        int interval_right_x = intervals[index].right_x;
+        if(interval_right_x < left_x || interval_left_x > right_x)
+        {
+            ++index;
+            continue;
+        }
+        bool keep_left = interval_left_x < left_x;
+        bool keep_right = interval_right_x > right_x;
+        if(keep_left && keep_right)
+        {
+            intervals[index].right_x = int16_t(left_x - 1);
+            if(intervals_count < _max_coverage_intervals)
+            {
+                for(int move_index = intervals_count; move_index > index + 1; --move_index)
+                {
+                    intervals[move_index] = intervals[move_index - 1];
+                }
+                intervals[index + 1] = { int16_t(right_x + 1), int16_t(interval_right_x) };
+                ++intervals_count;
+            }
+            break;
+        }
+        if(keep_left)
+        {
+            intervals[index].right_x = int16_t(left_x - 1);
+            ++index;
+        }
+        else if(keep_right)
+        {
+            intervals[index].left_x = int16_t(right_x + 1);
+            ++index;
+        }
+        else
+        {
+            --intervals_count;
+            for(int move_index = index; move_index < intervals_count; ++move_index)
+            {
+                intervals[move_index] = intervals[move_index + 1];
+            }
+        }
+    }
+    _coverage_interval_counts[y] = uint8_t(intervals_count);
+}
+bool ScanlineRenderer::_merge_scanline_span(
+        unsigned y, int left_x, int right_x, int color_index, unsigned shading,
+        const ScanlineSpriteAttributes& sprite_attributes)
+{
+    LastScanlineSpan& last_span = _last_scanline_spans[y];
+    int slots_end = last_span.slots_end;
+    if(! slots_end || slots_end != _scanline_sprite_counts[y])
+    {
+        return false;
+    }
+    if(last_span.color_index != color_index || last_span.shading != shading)
+    {
+        return false;
+    }
+    if(left_x > last_span.right_x + 1 || right_x < last_span.left_x - 1)
+    {
+        return false;
+    }
+    int merged_left_x = bn::min(left_x, int(last_span.left_x));
+    int merged_right_x = bn::max(right_x, int(last_span.right_x));
+    int attr1 = last_span.attr1;
+    int attr2 = last_span.attr2;
+    int length_limit = last_span.length_limit;
+    if(sprite_attributes.merge_length_limit > length_limit)
+    {
+        attr1 = sprite_attributes.attr1;
+        attr2 = sprite_attributes.attr2;
+        length_limit = sprite_attributes.merge_length_limit;
+    }
+    int length = merged_right_x - merged_left_x;
+    if(length > length_limit)
     {
         return false;
     }
-    _scanline_sprite_counts[y] = used_slots + slot_count;
+    uint16_t* sprite_hdma_source = _hdma_source + (y * _max_hdma_sprites * 4) + ((slots_end - 1) * 4);
+    _write_scanline_sprite(sprite_hdma_source, y, attr1, attr2, merged_left_x, bn::max(length, 1));
+    _scanline_slots[y][slots_end - 1] = { uint8_t(bn::min(length + 1, _max_slot_priority)), uint8_t(merged_left_x) };
+    last_span.left_x = int16_t(merged_left_x);
+    last_span.right_x = int16_t(merged_right_x);
+    last_span.attr1 = uint16_t(attr1);
+    last_span.attr2 = uint16_t(attr2);
+    last_span.length_limit = uint8_t(length_limit);
+    ++_merged_spans_count;
+    return true;
+}
+void ScanlineRenderer::_count_dropped_span(unsigned y)
+{
+    uint8_t& overflow_count = _scanline_overflow_counts[y];
+    if(overflow_count < bn::numeric_limits<uint8_t>::max())
+    {
+        ++overflow_count;
+    }
+    ++_dropped_spans_count;
+}
+int ScanlineRenderer::_evict_scanline_spans(unsigned y, int slot_count, int priority)
+{
+    ScanlineSlot* slots = _scanline_slots[y];
+    int used_slots = _scanline_sprite_counts[y];
+    int candidates_count = 0;
+    for(int slot_index = 0; slot_index < used_slots; ++slot_index)
+    {
+        if(slots[slot_index].priority < priority)
+        {
+            ++candidates_count;
+        }
+    }
+    if(candidates_count < slot_count)
+    {
+        return 0;
+    }
+    uint16_t* line_hdma_source = _hdma_source + (y * _max_hdma_sprites * 4);
+    int evicted_slots_count = 0;
+    while(evicted_slots_count < slot_count)
+    {
+        int evicted_slot_index = 0;
+        int evicted_priority = _pinned_slot_priority;
+        for(int slot_index = 0; slot_index < used_slots; ++slot_index)
+        {
+            const ScanlineSlot& slot = slots[slot_index];
+            if(slot.left_x != _continuation_slot_left_x && slot.priority < evicted_priority)
+            {
+                evicted_slot_index = slot_index;
+                evicted_priority = slot.priority;
+            }
+        }
+        int span_slots_count = 1;
+        while(evicted_slot_index + span_slots_count < used_slots &&
+              slots[evicted_slot_index + span_slots_count].left_x == _continuation_slot_left_x)
+        {
+            ++span_slots_count;
+        }
+        if(_span_coverage_enabled)
+        {
+            int evicted_left_x = slots[evicted_slot_index].left_x;
+            _remove_covered_span(y, evicted_left_x, evicted_left_x + evicted_priority - 1);
+        }
+        used_slots -= span_slots_count;
+        for(int slot_index = evicted_slot_index; slot_index < used_slots; ++slot_index)
+        {
+            slots[slot_index] = slots[slot_index + span_slots_count];
+            uint16_t* slot_hdma_source = line_hdma_source + (slot_index * 4);
+            const uint16_t* moved_hdma_source = slot_hdma_source + (span_slots_count * 4);
+            slot_hdma_source[0] = moved_hdma_source[0];
+            slot_hdma_source[1] = moved_hdma_source[1];
+            slot_hdma_source[2] = moved_hdma_source[2];
+            slot_hdma_source[3] = moved_hdma_source[3];
+        }
+        evicted_slots_count += span_slots_count;
+        _count_dropped_span(y);
+    }
+    _scanline_sprite_counts[y] = uint8_t(used_slots);
+    _last_scanline_spans[y].slots_end = 0;
+    return evicted_slots_count;
+}
+bool ScanlineRenderer::_reserve_scanline_slots(
+        unsigned y, int slot_count, int priority, ScanlineSlot first_slot, uint16_t*& sprite_hdma_source)
+{
+    int used_slots = _scanline_sprite_counts[y];
+    int overflow_count = used_slots + slot_count - _max_hdma_sprites;
+    if(overflow_count > 0) [[unlikely]]
+    {
+        int evicted_slots_count = _evict_scanline_spans(y, overflow_count, priority);
+        if(! evicted_slots_count)
+        {
+            _count_dropped_span(y);
+            return false;
+        }
+        used_slots -= evicted_slots_count;
+    }
+    ScanlineSlot* slots = _scanline_slots[y] + used_slots;
+    slots[0] = first_slot;
+    for(int slot_index = 1; slot_index < slot_count; ++slot_index)
+    {
+        slots[slot_index] = { first_slot.priority, _continuation_slot_left_x };
+    }
+    _scanline_sprite_counts[y] = uint8_t(used_slots + slot_count);
     sprite_hdma_source = _hdma_source + (y * _max_hdma_sprites * 4) + (used_slots * 4);
     return true;
 }
@@ -104,18 +609,44 @@ void ScanlineRenderer::_write_scanline_sprite(
             true, false, false, false);
     sprite_hdma_source[1] = attr1 + left_x;
     sprite_hdma_source[2] = attr2;
+    sprite_hdma_source[3] = 0;
+}
+void ScanlineRenderer::_write_wide_scanline_sprite(
+        uint16_t*& sprite_hdma_source, unsigned y, int attr1, int attr2, int left_x, int length)
+{
+    if(length < _min_wide_span_length)
+    {
+        _write_scanline_sprite(sprite_hdma_source, y, attr1, attr2, left_x, length);
+        return;
+    }
+    const WideSpanSprite& wide_span_sprite = _wide_span_sprites[length - _min_wide_span_length];
+    sprite_hdma_source[0] = bn::hw::sprites::first_attributes(
+            int(y) - 32 - wide_span_sprite.row, bn::sprite_shape::SQUARE, bn::bpp_mode::BPP_4, 3 << 8,
+            true, false, false, false);
+    sprite_hdma_source[1] = wide_span_sprite.attr1 | ((left_x - wide_span_sprite.offset) & 0x1FF);
+    sprite_hdma_source[2] = attr2;
+    sprite_hdma_source[3] = 0;
 }
 void ScanlineRenderer::_write_hidden_scanline_sprite(uint16_t*& sprite_hdma_source)
 {
     sprite_hdma_source[0] = ATTR0_HIDE;
     sprite_hdma_source[1] = 0;
     sprite_hdma_source[2] = 0;
+    sprite_hdma_source[3] = 0;
 }
 void ScanlineRenderer::add_scanline_spans(
         unsigned minimum_y, unsigned maximum_y, int width, bool x_outside, int color_index,
         unsigned shading, const ScanlineSpan* scanline_spans)
 {
     ScanlineSpriteAttributes sprite_attributes = _scanline_sprite_attributes(width, color_index, shading);
+#if STR_SCANLINE_ASM_KERNEL
+    if(! x_outside && sprite_attributes.segment_count == 1 && ! sprite_attributes.wide &&
+       ! window_spans_enabled())
+    {
+        minimum_y += unsigned(_emit_unclipped_scanline_spans(minimum_y, maximum_y, color_index, shading,
+                                                             sprite_attributes, scanline_spans));
+    }
+#endif
     for(unsigned y = minimum_y; y <= maximum_y; ++y)
     {
         int left_x = scanline_spans[y].left_x;
@@ -124,76 +655,355 @@ void ScanlineRenderer::add_scanline_spans(
         {
             continue;
         }
-        int needed_segments = sprite_attributes.segment_count;
-        if(needed_segments > 1) [[unlikely]]
-        {
-            int span_width = right_x - left_x;
-            if(span_width <= sprite_attributes.segment_length_limit)
-            {
-                needed_segments = 1;
-            }
-        }
-        uint16_t* sprite_hdma_source = nullptr;
-        if(! _reserve_scanline_slots(y, needed_segments, sprite_hdma_source)) [[unlikely]]
-        {
-            continue;
-        }
-        int segment_left_x = left_x;
-        for(int segment_index = 0; segment_index < needed_segments; ++segment_index)
+        _add_scanline_span(y, left_x, right_x, color_index, shading, sprite_attributes);
+    }
+}
+void ScanlineRenderer::add_scanline_span(unsigned y, int left_x, int right_x, int color_index, unsigned shading)
+{
+    ScanlineSpriteAttributes sprite_attributes =
+            _scanline_sprite_attributes(right_x - left_x + 1, color_index, shading);
+    _add_scanline_span(y, left_x, right_x, color_index, shading, sprite_attributes);
+}
+void ScanlineRenderer::_add_scanline_span(
+        unsigned y, int left_x, int right_x, int color_index, unsigned shading,
+        const ScanlineSpriteAttributes& sprite_attributes)
+{
+#if STR_WINDOW_SPANS
+    if(_window_spans_enabled) [[unlikely]]
+    {
+        const WindowSpan* window_spans = _window_spans[y];
+        for(int index = 0, window_spans_count = _window_span_counts[y]; index < window_spans_count; ++index)
         {
-            if(segment_left_x <= right_x) [[likely]]
+            int window_left_x = window_spans[index].left_x;
+            int window_right_x = window_spans[index].right_x;
+            if(window_left_x <= right_x && window_right_x >= left_x)
             {
-                int length = right_x - segment_left_x;
-                if(length <= 0) [[unlikely]]
+                if(left_x < window_left_x)
                 {
-                    length = 1;
+                    _add_scanline_span(y, left_x, window_left_x - 1, color_index, shading, sprite_attributes);
                 }
-                else if(length > sprite_attributes.segment_length_limit)
+                if(right_x > window_right_x)
                 {
-                    length = sprite_attributes.segment_length_limit;
+                    _add_scanline_span(y, window_right_x + 1, right_x, color_index, shading, sprite_attributes);
                 }
-                _write_scanline_sprite(
-                        sprite_hdma_source, y, sprite_attributes.attr1, sprite_attributes.attr2,
-                        segment_left_x, length);
-            }
-            else
-            {
-                _write_hidden_scanline_sprite(sprite_hdma_source);
+                return;
             }
-            segment_left_x += sprite_attributes.segment_length_limit;
-            sprite_hdma_source += 4;
         }
     }
-}
-void ScanlineRenderer::add_sprite(unsigned minimum_y, unsigned maximum_y, uint16_t attr0, uint16_t attr1, uint16_t attr2)
-{
-    for(unsigned y = minimum_y; y <= maximum_y; ++y)
+#endif
+    int covered_left_x = left_x;
+    int covered_right_x = right_x;
+    if(_span_coverage_enabled && ! _trim_covered_span(y, left_x, right_x))
     {
-        uint16_t* sprite_hdma_source = nullptr;
-        if(! _reserve_scanline_slots(y, 1, sprite_hdma_source)) [[unlikely]]
+        return;
+    }
+#if STR_WINDOW_SPANS
+    if(_window_spans_enabled && right_x - left_x >= _min_window_span_width &&
+       _assign_window_span(y, left_x, right_x, color_index, shading))
+    {
+        if(_span_coverage_enabled)
         {
-            continue;
+            _add_covered_span(y, covered_left_x, covered_right_x);
         }
-        sprite_hdma_source[0] = attr0;
-        sprite_hdma_source[1] = attr1;
-        sprite_hdma_source[2] = attr2;
+        return;
+    }
+#endif
+    if(_emit_scanline_sprites(y, left_x, right_x, color_index, shading, sprite_attributes) &&
+       _span_coverage_enabled)
+    {
+        _add_covered_span(y, covered_left_x, covered_right_x);
     }
 }
-void ScanlineRenderer::_hide_left_scanline_sprites(const uint8_t* previous_scanline_sprite_counts)
+#if STR_WINDOW_SPANS
+bool ScanlineRenderer::_assign_window_span(unsigned y, int left_x, int right_x, int color_index, unsigned shading)
 {
-    int screen_line_elements = _max_hdma_sprites * 4;
-    for(int y = 0; y < bn::display::height(); ++y)
+    WindowSpan* window_spans = _window_spans[y];
+    int window_spans_count = _window_span_counts[y];
+    WindowSpan window_span = { int16_t(left_x), int16_t(right_x), uint8_t(color_index), uint8_t(shading) };
+    if(window_spans_count < _max_window_spans)
     {
-        uint16_t* sprite_hdma_source = _hdma_source + (y * screen_line_elements);
-        int used_slots = _scanline_sprite_counts[y];
-        int previous_slots = previous_scanline_sprite_counts[y];
-        for(int slot_index = used_slots; slot_index < previous_slots; ++slot_index)
+        window_spans[window_spans_count] = window_span;
+        _window_span_counts[y] = uint8_t(window_spans_count + 1);
+        return true;
+    }
+    WindowSpan* narrowest_window_span = window_spans;
+    for(int index = 1; index < window_spans_count; ++index)
+    {
+        if(window_spans[index].right_x - window_spans[index].left_x <
+           narrowest_window_span->right_x - narrowest_window_span->left_x)
         {
-            sprite_hdma_source[slot_index * 4] = ATTR0_HIDE;
+            narrowest_window_span = window_spans + index;
         }
     }
+    if(narrowest_window_span->right_x - narrowest_window_span->left_x >= right_x - left_x)
+    {
+        return false;
+    }
+    WindowSpan evicted_window_span = *narrowest_window_span;
+    *narrowest_window_span = window_span;
+    int evicted_left_x = evicted_window_span.left_x;
+    int evicted_right_x = evicted_window_span.right_x;
+    ScanlineSpriteAttributes sprite_attributes = _scanline_sprite_attributes(
+            evicted_right_x - evicted_left_x + 1, evicted_window_span.color_index, evicted_window_span.shading);
+    if(! _emit_scanline_sprites(y, evicted_left_x, evicted_right_x, evicted_window_span.color_index,
+                                evicted_window_span.shading, sprite_attributes) && _span_coverage_enabled)
+    {
+        _remove_covered_span(y, evicted_left_x, evicted_right_x);
+    }
+    return true;
 }
-void Renderer::_render_frame(const Camera& camera)
+#endif
+bool ScanlineRenderer::_emit_scanline_sprites(
+        unsigned y, int left_x, int right_x, int color_index, unsigned shading,
+        const ScanlineSpriteAttributes& sprite_attributes)
+{
+    int needed_segments = sprite_attributes.segment_count;
+    if(needed_segments > 1) [[unlikely]]
+    {
+        int span_width = right_x - left_x;
+        if(span_width <= sprite_attributes.segment_length_limit)
+        {
+            needed_segments = 1;
+        }
+    }
+    if(needed_segments == 1 &&
+       _merge_scanline_span(y, left_x, right_x, color_index, shading, sprite_attributes))
+    {
+        return true;
+    }
+    int priority = bn::min(right_x - left_x + 1, _max_slot_priority);
+    ScanlineSlot first_slot = { uint8_t(priority), uint8_t(left_x) };
+    uint16_t* sprite_hdma_source = nullptr;
+    if(! _reserve_scanline_slots(y, needed_segments, priority, first_slot, sprite_hdma_source)) [[unlikely]]
+    {
+        return false;
+    }
+    if(needed_segments == 1)
+    {
+        _last_scanline_spans[y] = {
+            int16_t(left_x), int16_t(right_x), uint16_t(sprite_attributes.attr1),
+            uint16_t(sprite_attributes.attr2), _scanline_sprite_counts[y], uint8_t(color_index),
+            uint8_t(shading), uint8_t(sprite_attributes.merge_length_limit)
+        };
+    }
+    int segment_left_x = left_x;
+    for(int segment_index = 0; segment_index < needed_segments; ++segment_index)
+    {
+        if(segment_left_x <= right_x) [[likely]]
+        {
+            int length = right_x - segment_left_x;
+            if(length <= 0) [[unlikely]]
+            {
+                length = 1;
+            }
+            else if(length > sprite_attributes.segment_length_limit)
+            {
+                length = sprite_attributes.segment_length_limit;
+            }
+            if(sprite_attributes.wide)
+            {
+                _write_wide_scanline_sprite(
+                        sprite_hdma_source, y, sprite_attributes.attr1, sprite_attributes.attr2,
+                        segment_left_x, length);
+            }
+            else
+            {
+                _write_scanline_sprite(
+                        sprite_hdma_source, y, sprite_attributes.attr1, sprite_attributes.attr2,
+                        segment_left_x, length);
+            }
+        }
+        else
+        {
+            _write_hidden_scanline_sprite(sprite_hdma_source);
+        }
+        segment_left_x += sprite_attributes.segment_length_limit;
+        sprite_hdma_source += 4;
+    }
+    return true;
+}
+int ScanlineRenderer::_emit_unclipped_scanline_spans(
+        unsigned minimum_y, unsigned maximum_y, int color_index, unsigned shading,
+        const ScanlineSpriteAttributes& sprite_attributes, const ScanlineSpan* scanline_spans)
+{
+    static_assert(sizeof(ScanlineSlot) == 2 && sizeof(LastScanlineSpan) == 12,
+                  "The ARM span kernel expects packed slot and last span records");
+    if(_span_coverage_enabled && _coverage_overlaps(minimum_y, maximum_y, scanline_spans))
+    {
+        return 0;
+    }
+    ScanlineSpanKernelArgs args = {
+        scanline_spans + minimum_y,
+        _hdma_source + (minimum_y * _max_hdma_sprites * 4),
+        _scanline_sprite_counts + minimum_y,
+        reinterpret_cast<uint16_t*>(_scanline_slots[minimum_y]),
+        reinterpret_cast<uint32_t*>(_last_scanline_spans + minimum_y),
+        int(maximum_y - minimum_y + 1),
+        int(minimum_y),
+        bn::hw::sprites::first_attributes(
+                0, bn::sprite_shape::SQUARE, bn::bpp_mode::BPP_4, 0, true, false, false, false),
+        sprite_attributes.attr1,
+        sprite_attributes.attr2,
+        int(unsigned(sprite_attributes.attr1) | (unsigned(sprite_attributes.attr2) << 16)),
+        (color_index << 8) | (int(shading) << 16) | (sprite_attributes.merge_length_limit << 24),
+        color_index | (int(shading) << 8),
+        _max_hdma_sprites,
+        int(sizeof(_hdma_source[0]) * _max_hdma_sprites * 4),
+        int(sizeof(_scanline_slots[0])),
+        int(sizeof(LastScanlineSpan))
+    };
+    int emitted_lines_count = str_scanline_emit_spans(&args);
+    if(_span_coverage_enabled)
+    {
+        unsigned emitted_maximum_y = minimum_y + unsigned(emitted_lines_count);
+        for(unsigned y = minimum_y; y < emitted_maximum_y; ++y)
+        {
+            _add_covered_span(y, scanline_spans[y].left_x, scanline_spans[y].right_x);
+        }
+    }
+    return emitted_lines_count;
+}
+void ScanlineRenderer::add_sprite(unsigned minimum_y, unsigned maximum_y, uint16_t attr0, uint16_t attr1, uint16_t attr2)
+{
+    for(unsigned y = minimum_y; y <= maximum_y; ++y)
+    {
+        uint16_t* sprite_hdma_source = nullptr;
+        if(! _reserve_scanline_slots(y, 1, _pinned_slot_priority, { _pinned_slot_priority, 0 },
+                                     sprite_hdma_source)) [[unlikely]]
+        {
+            continue;
+        }
+        sprite_hdma_source[0] = attr0;
+        sprite_hdma_source[1] = attr1;
+        sprite_hdma_source[2] = attr2;
+        sprite_hdma_source[3] = 0;
+    }
+}
+void ScanlineRenderer::_pack_scanline_sprites(int transfer_slots)
+{
+    int screen_line_elements = _max_hdma_sprites * 4;
+    int transfer_line_elements = transfer_slots * 4;
+    for(int y = 0; y < bn::display::height(); ++y)
+    {
+        const uint16_t* source_hdma_source = _hdma_source + (y * screen_line_elements);
+        uint16_t* sprite_hdma_source = _hdma_source + (y * transfer_line_elements);
+        int used_slots = _scanline_sprite_counts[y];
+        if(sprite_hdma_source != source_hdma_source)
+        {
+            for(int slot_index = 0; slot_index < used_slots; ++slot_index)
+            {
+                int element_index = slot_index * 4;
+                sprite_hdma_source[element_index] = source_hdma_source[element_index];
+                sprite_hdma_source[element_index + 1] = source_hdma_source[element_index + 1];
+                sprite_hdma_source[element_index + 2] = source_hdma_source[element_index + 2];
+                sprite_hdma_source[element_index + 3] = source_hdma_source[element_index + 3];
+            }
+        }
+        for(int slot_index = used_slots; slot_index < transfer_slots; ++slot_index)
+        {
+            int element_index = slot_index * 4;
+            sprite_hdma_source[element_index] = ATTR0_HIDE;
+            sprite_hdma_source[element_index + 1] = 0;
+            sprite_hdma_source[element_index + 2] = 0;
+            sprite_hdma_source[element_index + 3] = 0;
+        }
+    }
+}
+bool AffineFloorRenderer::add_floor(
+        const TiledFloorItem& floor_item, unsigned shading, const int64_t (&screen_matrix)[9],
+        unsigned minimum_y, unsigned maximum_y, const ScanlineRenderer::ScanlineSpan* scanline_spans)
+{
+    constexpr int display_width = bn::display::width();
+    if(! _bg || _floor_added)
+    {
+        return false;
+    }
+    int64_t m[9];
+    for(int index = 0; index < 9; ++index)
+    {
+        m[index] = screen_matrix[index];
+    }
+    normalize_projective_matrix(m);
+    int64_t inverse[9] = {
+        (m[4] * m[8]) - (m[5] * m[7]), (m[2] * m[7]) - (m[1] * m[8]), (m[1] * m[5]) - (m[2] * m[4]),
+        (m[5] * m[6]) - (m[3] * m[8]), (m[0] * m[8]) - (m[2] * m[6]), (m[2] * m[3]) - (m[0] * m[5]),
+        (m[3] * m[7]) - (m[4] * m[6]), (m[1] * m[6]) - (m[0] * m[7]), (m[0] * m[4]) - (m[1] * m[3])
+    };
+    normalize_projective_matrix(inverse);
+    int64_t determinant = (inverse[6] * m[2]) + (inverse[7] * m[5]) + (inverse[8] * m[8]);
+    if(! determinant)
+    {
+        return false;
+    }
+    if(determinant < 0)
+    {
+        for(int64_t& value : inverse)
+        {
+            value = -value;
+        }
+    }
+    int texture_width = floor_item.columns() * _tile_texels;
+    int texture_height = floor_item.rows() * _tile_texels;
+    auto texel = [&inverse, texture_width, texture_height](int x, int y, int& u, int& v)
+    {
+        int64_t w = (inverse[6] * x) + (inverse[7] * y) + inverse[8];
+        if(w <= 0)
+        {
+            return false;
+        }
+        int64_t s = (inverse[0] * x) + (inverse[1] * y) + inverse[2];
+        int64_t t = (inverse[3] * x) + (inverse[4] * y) + inverse[5];
+        int shift = (64 - __builtin_clzll(uint64_t(w))) - 12;
+        if(shift > 0)
+        {
+            w >>= shift;
+            s >>= shift;
+            t >>= shift;
+        }
+        else
+        {
+            w <<= -shift;
+            s <<= -shift;
+            t <<= -shift;
+        }
+        u = (fr::unsafe_unsigned_lut_division<16>(int(s), int(w)).data() * texture_width) >> 8;
+        v = (fr::unsafe_unsigned_lut_division<16>(int(t), int(w)).data() * texture_height) >> 8;
+        return true;
+    };
+    uint16_t* hdma_source = _hdma_source;
+    for(int y = 0; y < bn::display::height(); ++y)
+    {
+        write_affine_floor_line(hdma_source + (y * _hdma_line_elements), 0, 0,
+                                affine_floor_hidden_position, affine_floor_hidden_position);
+    }
+    for(unsigned y = minimum_y; y <= maximum_y; ++y)
+    {
+        const ScanlineRenderer::ScanlineSpan& scanline_span = scanline_spans[y];
+        int left_x = bn::max(scanline_span.left_x, 0);
+        int right_x = bn::min(scanline_span.right_x, display_width - 1);
+        int left_u;
+        int left_v;
+        int right_u;
+        int right_v;
+        if(left_x > right_x || ! texel(left_x, int(y), left_u, left_v) || ! texel(right_x, int(y), right_u, right_v))
+        {
+            continue;
+        }
+        int pa = 0;
+        int pc = 0;
+        if(int delta_x = right_x - left_x)
+        {
+            pa = (fr::unsafe_unsigned_lut_division<8>(right_u - left_u, delta_x).data() + 128) >> 8;
+            pc = (fr::unsafe_unsigned_lut_division<8>(right_v - left_v, delta_x).data() + 128) >> 8;
+        }
+        write_affine_floor_line(hdma_source + (y * _hdma_line_elements), pa, pc,
+                                left_u - (pa * left_x), left_v - (pc * left_x));
+    }
+    _load_floor(floor_item, shading);
+    _floor_added = true;
+    return true;
+}
+bool Renderer::_render_frame(const Camera& camera)
 {
     constexpr int display_width = bn::display::width();
     constexpr int display_height = bn::display::height();
@@ -201,8 +1011,30 @@ void Renderer::_render_frame(const Camera& camera)
     static BN_DATA_EWRAM_BSS ScreenPoint projected_vertices[_max_vertices];
     static BN_DATA_EWRAM_BSS bool projected_vertices_valid[_max_vertices];
     static BN_DATA_EWRAM_BSS ProjectedFace valid_faces_info[_max_faces];
+    static BN_DATA_EWRAM_BSS int edge_deltas[_max_edges];
+    static BN_DATA_EWRAM_BSS ProjectedFloor projected_floors[max_dynamic_models];
     static BN_DATA_EWRAM_BSS int visible_face_projected_zs[_max_faces];
-    static BN_DATA_EWRAM_BSS uint8_t visible_face_indexes[_max_faces];
+    static BN_DATA_EWRAM_BSS RenderLayer visible_face_layers[_max_faces];
+    static BN_DATA_EWRAM_BSS face_index_type visible_face_indexes[_max_faces];
+    static BN_DATA_EWRAM_BSS face_index_type unsorted_visible_face_indexes[_max_faces];
+    static BN_DATA_EWRAM_BSS face_index_type layered_visible_face_indexes[_max_faces];
+    static BN_DATA_EWRAM_BSS face_index_type previous_visible_face_indexes[_max_faces];
+    static BN_DATA_EWRAM_BSS face_index_type radix_sort_visible_face_indexes[_max_faces];
+    static BN_DATA_EWRAM_BSS bool visible_face_indexes_pending[_max_faces];
+    static BN_DATA_EWRAM_BSS ProjectedBillboard projected_billboards[max_billboards];
+    static BN_DATA_EWRAM_BSS uint16_t billboard_render_order[max_billboards];
+    static BN_DATA_EWRAM_BSS SpriteAffineMatPool::Key affine_mat_keys[max_sprites + max_billboards];
+    static BN_DATA_EWRAM_BSS uint8_t affine_mat_indexes[max_sprites + max_billboards];
+    static BN_DATA_EWRAM_BSS RotatedPoint instanced_vertices[_max_instanced_vertices];
+    static BN_DATA_EWRAM_BSS ClassifiedFace instanced_faces[_max_instanced_faces];
+    static_assert(sizeof(Renderer) + sizeof(projected_vertices) + sizeof(projected_vertices_valid) +
+                  sizeof(valid_faces_info) + sizeof(edge_deltas) + sizeof(projected_floors) +
+                  sizeof(visible_face_projected_zs) + sizeof(visible_face_layers) + (sizeof(visible_face_indexes) * 5) +
+                  sizeof(visible_face_indexes_pending) + sizeof(projected_billboards) +
+                  sizeof(billboard_render_order) + sizeof(affine_mat_keys) + sizeof(affine_mat_indexes) +
+                  sizeof(instanced_vertices) + sizeof(instanced_faces) <=
+                  RendererCapacities::max_ewram_size,
+                  "Renderer capacities don't fit in their EWRAM budget");
     fr::point_3d camera_position = camera.position();
     bn::fixed camera_yaw = camera.yaw();
     bn::fixed camera_u_x = camera.right_axis().x();
@@ -212,24 +1044,231 @@ void Renderer::_render_frame(const Camera& camera)
     VisibleRenderItem* visible_faces = _visible_render_items;
     int visible_faces_count = 0;
     bool geometry_cache_hit = false;
-    auto project_screen_point = [&](const fr::point_3d& world_point, ScreenPoint& projected_point)
+    auto depth_scale = [](int camera_depth)
+    {
+        return int((fr::div_lut_ptr[camera_depth >> 10] << (focal_length_shift - 8)) >> 6);
+    };
+    auto build_model_view_matrix = [&](const Model& model, ModelViewMatrix& matrix)
     {
-        bn::fixed view_y = world_point.y() - camera_position.y();
-        int camera_depth = -view_y.data();
-        int div_lut_index = camera_depth >> 10;
-        if(camera_depth < near_plane || div_lut_index > div_lut_max_index)
+        fr::point_3d x_axis = model.x_axis();
+        fr::point_3d y_axis = model.y_axis();
+        fr::point_3d z_axis = model.z_axis();
+        int64_t scale = model.scale().data();
+        int x_axis_values[3] = { x_axis.x().data(), x_axis.y().data(), x_axis.z().data() };
+        int y_axis_values[3] = { y_axis.x().data(), y_axis.y().data(), y_axis.z().data() };
+        int z_axis_values[3] = { z_axis.x().data(), z_axis.y().data(), z_axis.z().data() };
+        for(int column = 0; column < 3; ++column)
         {
-            return false;
+            int64_t x_value = x_axis_values[column];
+            int64_t z_value = z_axis_values[column];
+            int64_t projected_x = (x_value * camera_u_x.data()) + (z_value * camera_u_z.data());
+            int64_t projected_y = -((x_value * camera_v_x.data()) + (z_value * camera_v_z.data()));
+            matrix.rows[0][column] = int((projected_x * scale) >> 12);
+            matrix.rows[1][column] = int((projected_y * scale) >> 12);
+            matrix.rows[2][column] = int(-(y_axis_values[column] * scale));
         }
-        bn::fixed view_x = (world_point.x() - camera_position.x()) / 16;
-        bn::fixed view_z = (world_point.z() - camera_position.z()) / 16;
-        int projected_x = (view_x.unsafe_multiplication(camera_u_x) + view_z.unsafe_multiplication(camera_u_z)).data();
-        int projected_y = -(view_x.unsafe_multiplication(camera_v_x) + view_z.unsafe_multiplication(camera_v_z)).data();
-        int scale = int((fr::div_lut_ptr[div_lut_index] << (focal_length_shift - 8)) >> 6);
+        fr::point_3d view_position = model.position() - camera_position;
+        int64_t view_x = view_position.x().data();
+        int64_t view_z = view_position.z().data();
+        matrix.translations[0] = ((view_x * camera_u_x.data()) + (view_z * camera_u_z.data())) << 12;
+        matrix.translations[1] = -(((view_x * camera_v_x.data()) + (view_z * camera_v_z.data())) << 12);
+        matrix.translations[2] = -(int64_t(view_position.y().data()) << model_view_matrix_bits);
+    };
+    auto model_view_rotation = [](const ModelViewMatrix& matrix, int row, const fr::point_3d& point)
+    {
+        const int* row_values = matrix.rows[row];
+        return (int64_t(row_values[0]) * point.x().data()) + (int64_t(row_values[1]) * point.y().data()) +
+               (int64_t(row_values[2]) * point.z().data());
+    };
+    auto model_view_dot = [&](const ModelViewMatrix& matrix, int row, const fr::point_3d& point)
+    {
+        return model_view_rotation(matrix, row, point) + matrix.translations[row];
+    };
+    auto model_point_depth = [&](const ModelViewMatrix& matrix, const fr::point_3d& point)
+    {
+        return int(model_view_dot(matrix, 2, point) >> model_view_matrix_bits);
+    };
+    auto rotate_model_point = [&](const ModelViewMatrix& matrix, const fr::point_3d& point, RotatedPoint& rotated)
+    {
+        rotated.values[0] = model_view_rotation(matrix, 0, point);
+        rotated.values[1] = model_view_rotation(matrix, 1, point);
+        rotated.values[2] = model_view_rotation(matrix, 2, point);
+    };
+    auto rotated_point_depth = [](const ModelViewMatrix& matrix, const RotatedPoint& rotated)
+    {
+        return int((rotated.values[2] + matrix.translations[2]) >> model_view_matrix_bits);
+    };
+    auto project_visible_rotated_point = [&](const ModelViewMatrix& matrix, const RotatedPoint& rotated,
+                                             int camera_depth, ScreenPoint& projected_point)
+    {
+        int scale = depth_scale(camera_depth);
+        int projected_x = int((rotated.values[0] + matrix.translations[0]) >> model_view_screen_shift);
+        int projected_y = int((rotated.values[1] + matrix.translations[1]) >> model_view_screen_shift);
         projected_point = {
             int16_t(((projected_x * scale) >> 16) + (display_width / 2)),
             int16_t(((projected_y * scale) >> 16) + (display_height / 2))
         };
+    };
+    auto project_rotated_point = [&](const ModelViewMatrix& matrix, const RotatedPoint& rotated,
+                                     ScreenPoint& projected_point)
+    {
+        int camera_depth = rotated_point_depth(matrix, rotated);
+        if(camera_depth < near_plane || (camera_depth >> 10) > div_lut_max_index)
+        {
+            return false;
+        }
+        project_visible_rotated_point(matrix, rotated, camera_depth, projected_point);
+        return true;
+    };
+    auto project_model_point = [&](const ModelViewMatrix& matrix, const fr::point_3d& point,
+                                   ScreenPoint& projected_point)
+    {
+        RotatedPoint rotated;
+        rotate_model_point(matrix, point, rotated);
+        return project_rotated_point(matrix, rotated, projected_point);
+    };
+    auto same_instance_set = [](const Model& model, const Model& other)
+    {
+        return &model.item() == &other.item() && model.floor_item() == other.floor_item() &&
+               model.x_axis() == other.x_axis() && model.y_axis() == other.y_axis() &&
+               model.z_axis() == other.z_axis() && model.scale() == other.scale() &&
+               model.layering_mode() == other.layering_mode() && model.render_layer() == other.render_layer() &&
+               model.double_sided() == other.double_sided();
+    };
+    enum class BoundsVisibility
+    {
+        outside,
+        clipped,
+        inside
+    };
+    auto model_bounds_visibility = [&](const Model& model, const ModelViewMatrix& matrix)
+    {
+        const ModelBounds* bounds = model.bounds();
+        if(! bounds)
+        {
+            return BoundsVisibility::clipped;
+        }
+        const fr::point_3d& center = bounds->center();
+        int radius = bounds->radius().unsafe_multiplication(model.scale()).data() + model_bounds_margin;
+        int camera_depth = model_point_depth(matrix, center);
+        int near_depth = camera_depth - radius;
+        int far_depth = camera_depth + radius;
+        if(far_depth < near_plane || (near_depth >> 10) > div_lut_max_index)
+        {
+            return BoundsVisibility::outside;
+        }
+        int64_t near_scale = depth_scale(bn::max(near_depth, near_plane));
+        int64_t far_scale = depth_scale(bn::min(far_depth, (div_lut_max_index << 10) + 1023));
+        int projected_x = int(model_view_dot(matrix, 0, center) >> model_view_screen_shift);
+        int projected_y = int(model_view_dot(matrix, 1, center) >> model_view_screen_shift);
+        int projected_radius = (radius / 16) + 1;
+        auto screen_range = [&](int projected, int center_offset, int& minimum, int& maximum)
+        {
+            int64_t low = projected - projected_radius;
+            int64_t high = projected + projected_radius;
+            minimum = int(bn::min(low * near_scale, low * far_scale) >> 16) + center_offset;
+            maximum = int(bn::max(high * near_scale, high * far_scale) >> 16) + center_offset;
+        };
+        int minimum_x, maximum_x, minimum_y, maximum_y;
+        screen_range(projected_x, display_width / 2, minimum_x, maximum_x);
+        screen_range(projected_y, display_height / 2, minimum_y, maximum_y);
+        if(maximum_x < 0 || minimum_x >= display_width || maximum_y < 0 || minimum_y >= display_height)
+        {
+            return BoundsVisibility::outside;
+        }
+        if(near_depth >= near_plane && (far_depth >> 10) <= div_lut_max_index && minimum_x >= 0 &&
+           maximum_x < display_width && minimum_y >= 0 && maximum_y < display_height)
+        {
+            return BoundsVisibility::inside;
+        }
+        return BoundsVisibility::clipped;
+    };
+    auto project_floor = [&](const Model& model, const ModelViewMatrix& matrix, ProjectedFloor& projected_floor)
+    {
+        const TiledFloorItem& floor_item = *model.floor_item();
+        const fr::face_3d& face = floor_item.face();
+        const fr::vertex_3d* model_vertices = model.item().vertices().data();
+        const fr::point_3d& p0 = model_vertices[face.first_vertex_index()].point();
+        const fr::point_3d& p1 = model_vertices[face.second_vertex_index()].point();
+        const fr::point_3d& p2 = model_vertices[face.third_vertex_index()].point();
+        const fr::point_3d& p3 = model_vertices[face.fourth_vertex_index()].point();
+        auto project_floor_point = [&](const fr::point_3d& start, const fr::point_3d& end, int step, int steps,
+                                       ScreenPoint& projected_point)
+        {
+            fr::point_3d floor_point(start.x() + ((end.x() - start.x()) * step) / steps,
+                                     start.y() + ((end.y() - start.y()) * step) / steps,
+                                     start.z() + ((end.z() - start.z()) * step) / steps);
+            return project_model_point(matrix, floor_point, projected_point);
+        };
+        int floor_depth = model_point_depth(matrix, p0);
+        if(floor_depth < near_plane || (floor_depth >> 10) > div_lut_max_index)
+        {
+            return false;
+        }
+        int64_t floor_scale = int64_t(depth_scale(floor_depth)) * floor_depth;
+        int64_t screen_points[3][3];
+        const fr::point_3d* texture_points[3] = { &p1, &p3, &p0 };
+        for(int index = 0; index < 3; ++index)
+        {
+            const fr::point_3d& point = *texture_points[index];
+            int64_t weight = model_view_dot(matrix, 2, point) >> (model_view_matrix_bits - 16);
+            screen_points[index][0] = ((model_view_dot(matrix, 0, point) >> model_view_screen_shift) * floor_scale) +
+                                      (((display_width - 1) * weight) >> 1);
+            screen_points[index][1] = ((model_view_dot(matrix, 1, point) >> model_view_screen_shift) * floor_scale) +
+                                      (((display_height - 1) * weight) >> 1);
+            screen_points[index][2] = weight;
+        }
+        for(int row = 0; row < 3; ++row)
+        {
+            projected_floor.screen_matrix[(row * 3)] = screen_points[0][row] - screen_points[2][row];
+            projected_floor.screen_matrix[(row * 3) + 1] = screen_points[1][row] - screen_points[2][row];
+            projected_floor.screen_matrix[(row * 3) + 2] = screen_points[2][row];
+        }
+        projected_floor.item = &floor_item;
+        FloorLine* floor_line = projected_floor.lines;
+        for(int axis = 0; axis < 2; ++axis)
+        {
+            int tiles = axis ? floor_item.rows() : floor_item.columns();
+            const fr::point_3d& first_end = axis ? p3 : p1;
+            const fr::point_3d& second_start = axis ? p1 : p3;
+            ScreenPoint first_points[TiledFloorItem::max_tiles + 1];
+            ScreenPoint second_points[TiledFloorItem::max_tiles];
+            for(int step = 1; step <= tiles; ++step)
+            {
+                if(! project_floor_point(p0, first_end, step, tiles, first_points[step]))
+                {
+                    return false;
+                }
+                if(step < tiles && ! project_floor_point(second_start, p2, step, tiles, second_points[step]))
+                {
+                    return false;
+                }
+            }
+            for(int step = 1; step < tiles; ++step)
+            {
+                const ScreenPoint* top_point = &first_points[step];
+                const ScreenPoint* bottom_point = &second_points[step];
+                const ScreenPoint& next_point = first_points[step + 1];
+                int delta_x = bottom_point->x - top_point->x;
+                int delta_y = bottom_point->y - top_point->y;
+                int next_side = (delta_x * (next_point.y - top_point->y)) - (delta_y * (next_point.x - top_point->x));
+                int side_sign = (next_side > 0) - (next_side < 0);
+                int direction = -delta_y * side_sign;
+                floor_line->direction = int8_t((direction > 0) - (direction < 0));
+                floor_line->side = int8_t(delta_y ? 0 : ((delta_x * side_sign > 0) - (delta_x * side_sign < 0)));
+                if(delta_y < 0)
+                {
+                    bn::swap(top_point, bottom_point);
+                    delta_x = -delta_x;
+                    delta_y = -delta_y;
+                }
+                floor_line->origin_x = fixed(top_point->x).data();
+                floor_line->origin_y = top_point->y;
+                floor_line->slope = delta_y ?
+                        fr::unsafe_unsigned_lut_division<fixed_precision>(delta_x, delta_y).data() : 0;
+                ++floor_line;
+            }
+        }
         return true;
     };
     auto face_vertices_are_visible = [](const fr::face_3d& face, const bool* vertices_valid)
@@ -239,304 +1278,855 @@ void Renderer::_render_frame(const Camera& camera)
                vertices_valid[face.third_vertex_index()] &&
                vertices_valid[face.fourth_vertex_index()];
     };
-    if(_geometry_cache_valid && _cached_models_revision == _models_revision &&
-       _cached_camera_position == camera_position && _cached_camera_yaw == camera_yaw)
+    auto classify_face = [&](const Model& model, const fr::face_3d& face, bool floor_item,
+                             const fr::point_3d& model_y_axis, ClassifiedFace& classified)
     {
-        int cached_model_index = 0;
-        geometry_cache_hit = true;
-        for(const Model& model : _models_list)
+        const fr::point_3d& normal = face.normal().point();
+        int color_index = face.color_index();
+        bool room_floor_surface = color_index >= 0 && color_index <= 5;
+        bool room_shell_surface = color_index >= 6 && color_index <= 8;
+        bool room_main_wall_surface = color_index == 6;
+        bool room_perspective_mode = model.layering_mode() == Model::LayeringMode::room_perspective;
+        bool room_floor_only_mode = model.layering_mode() == Model::LayeringMode::room_floor_only;
+        bool near_shell_surface = room_perspective_mode && room_shell_surface &&
+                                  normal.safe_dot_product(model_y_axis) < room_near_wall_cull_normal_y_max;
+        FaceRenderRule render_rule = FaceRenderRule::front_facing;
+        if(room_floor_surface)
         {
-            if(cached_model_index >= _cached_models_count ||
-               _cached_models[cached_model_index] != &model ||
-               _cached_model_versions[cached_model_index] != model.version())
+            if(! room_perspective_mode && ! room_floor_only_mode)
             {
-                geometry_cache_hit = false;
-                break;
+                render_rule = FaceRenderRule::never;
+            }
+        }
+        else if(room_shell_surface && room_floor_only_mode)
+        {
+            render_rule = FaceRenderRule::never;
+        }
+        else if(near_shell_surface)
+        {
+            render_rule = FaceRenderRule::never;
+        }
+        else
+        {
+            bool allow_double_sided = model.double_sided();
+            if(room_shell_surface)
+            {
+                allow_double_sided = room_main_wall_surface;
+            }
+            if(allow_double_sided)
+            {
+                render_rule = FaceRenderRule::always;
+            }
+        }
+        bn::fixed centroid_view_y = face.centroid().point().safe_dot_product(model_y_axis);
+        bn::fixed model_scale = model.scale();
+        if(model_scale != 1)
+        {
+            centroid_view_y = centroid_view_y.unsafe_multiplication(model_scale);
+        }
+        RenderLayer layer = model.render_layer();
+        if(floor_item && room_perspective_mode)
+        {
+            layer = RenderLayer::room_floor;
+        }
+        else if(room_perspective_mode)
+        {
+            layer = near_shell_surface ? RenderLayer::room_front : RenderLayer::room_back;
+        }
+        else if(room_floor_only_mode)
+        {
+            layer = room_floor_surface ? RenderLayer::adjacent_room_floor : RenderLayer::adjacent_room;
+        }
+        classified = { centroid_view_y.data(), render_rule, layer };
+    };
+    auto select_model_lod = [&](const Model& model)
+    {
+        const bn::span<const ModelLod>& lods = model.lods();
+        int lods_count = lods.size();
+        const ModelBounds& bounds = *model.bounds();
+        ModelViewMatrix model_view_matrix;
+        build_model_view_matrix(model, model_view_matrix);
+        int camera_depth = model_point_depth(model_view_matrix, bounds.center());
+        if(camera_depth < near_plane)
+        {
+            return 0;
+        }
+        if((camera_depth >> 10) > div_lut_max_index)
+        {
+            return lods_count - 1;
+        }
+        int radius = bounds.radius().unsafe_multiplication(model.scale()).data();
+        int screen_radius = int((int64_t(radius / 16) * depth_scale(camera_depth)) >> 16);
+        int current_lod_index = model.lod_index();
+        for(int lod_index = 0; lod_index < lods_count - 1; ++lod_index)
+        {
+            int min_screen_radius = lods[lod_index].min_screen_radius();
+            if(lod_index < current_lod_index)
+            {
+                min_screen_radius += model_lod_hysteresis;
+            }
+            if(screen_radius >= min_screen_radius)
+            {
+                return lod_index;
             }
-            ++cached_model_index;
         }
-        if(geometry_cache_hit && cached_model_index != _cached_models_count)
+        return lods_count - 1;
+    };
+    bool camera_changed = ! _geometry_cache_valid || _cached_models_revision != _models_revision ||
+                          _cached_camera_position != camera_position || _cached_camera_yaw != camera_yaw;
+    for(Model& model : _models_list)
+    {
+        if(model.lods().size() > 1 && (camera_changed || model._lod_version != model.version()))
+        {
+            model._set_lod_index(select_model_lod(model));
+            model._lod_version = model.version();
+        }
+    }
+    const Model* models[max_dynamic_models];
+    bool models_dirty[max_dynamic_models];
+    int model_vertex_offsets[max_dynamic_models];
+    int model_edge_offsets[max_dynamic_models];
+    int model_face_offsets[max_dynamic_models];
+    int model_valid_faces_counts[max_dynamic_models];
+    int models_count = 0;
+    int models_vertex_offset = 0;
+    int models_edge_offset = 0;
+    int models_face_offset = _model_faces_count;
+    geometry_cache_hit = true;
+    bool shell_changed = camera_changed;
+    for(const Model& model : _models_list)
+    {
+        bool model_dirty = camera_changed || _cached_models[models_count] != &model ||
+                           _cached_model_versions[models_count] != model.version();
+        if(model_dirty)
         {
             geometry_cache_hit = false;
+            if(model.render_layer() != RenderLayer::dynamic)
+            {
+                shell_changed = true;
+            }
         }
+        models_face_offset -= model.reserved_render_items_count();
+        models[models_count] = &model;
+        models_dirty[models_count] = model_dirty;
+        model_vertex_offsets[models_count] = models_vertex_offset;
+        model_edge_offsets[models_count] = models_edge_offset;
+        model_face_offsets[models_count] = models_face_offset;
+        models_vertex_offset += model.reserved_vertices_count();
+        models_edge_offset += model.reserved_edges_count();
+        ++models_count;
     }
     if(! geometry_cache_hit)
     {
-        int global_vertex_index = 0;
-        int valid_faces_count = 0;
         RV_PROFILER_START("dynamic_project");
-        for(Model& model : _models_list)
+        int model_instance_sources[max_dynamic_models];
+        int instance_vertex_offsets[max_dynamic_models];
+        int instance_face_offsets[max_dynamic_models];
+        int instanced_vertices_count = 0;
+        int instanced_faces_count = 0;
+        for(int model_index = 0; model_index < models_count; ++model_index)
+        {
+            model_instance_sources[model_index] = -1;
+            instance_vertex_offsets[model_index] = -1;
+            instance_face_offsets[model_index] = -1;
+        }
+        for(int model_index = 0; model_index < models_count; ++model_index)
+        {
+            if(! models_dirty[model_index] || model_instance_sources[model_index] >= 0)
+            {
+                continue;
+            }
+            for(int other_index = model_index + 1; other_index < models_count; ++other_index)
+            {
+                if(models_dirty[other_index] && model_instance_sources[other_index] < 0 &&
+                   same_instance_set(*models[model_index], *models[other_index]))
+                {
+                    model_instance_sources[model_index] = model_index;
+                    model_instance_sources[other_index] = model_index;
+                }
+            }
+        }
+        for(int model_index = 0; model_index < models_count; ++model_index)
         {
+            if(! models_dirty[model_index])
+            {
+                continue;
+            }
+            const Model& model = *models[model_index];
+            ModelViewMatrix model_view_matrix;
+            build_model_view_matrix(model, model_view_matrix);
+            BoundsVisibility model_visibility = model_bounds_visibility(model, model_view_matrix);
+            if(model_visibility == BoundsVisibility::outside)
+            {
+                model_valid_faces_counts[model_index] = 0;
+                continue;
+            }
+            bool model_inside = model_visibility == BoundsVisibility::inside;
             const fr::model_3d_item& model_item = model.item();
             const fr::vertex_3d* model_vertices = model_item.vertices().data();
-            ScreenPoint* model_projected_vertices = projected_vertices + global_vertex_index;
-            bool* model_projected_vertices_valid = projected_vertices_valid + global_vertex_index;
+            ScreenPoint* model_projected_vertices = projected_vertices + model_vertex_offsets[model_index];
+            bool* model_projected_vertices_valid = projected_vertices_valid + model_vertex_offsets[model_index];
+            int* model_edge_deltas = edge_deltas + model_edge_offsets[model_index];
+            ProjectedFace* model_valid_faces = valid_faces_info + model_face_offsets[model_index];
+            int model_valid_faces_count = 0;
             int model_vertices_count = model_item.vertices().size();
-            bool model_double_sided = model.double_sided();
-            for(int index = 0; index < model_vertices_count; ++index)
-            {
-                fr::point_3d model_point = model.transform(model_vertices[index]);
-                model_projected_vertices_valid[index] =
-                    project_screen_point(model_point, model_projected_vertices[index]);
-            }
+            int model_render_items_count = model.render_items_count();
             const fr::face_3d* model_faces = model_item.faces().data();
             int model_faces_count = model_item.faces().size();
-            for(int index = model_faces_count - 1; index >= 0; --index)
+            fr::point_3d model_y_axis = model.y_axis();
+            const RotatedPoint* model_rotated_vertices = nullptr;
+            const ClassifiedFace* model_classified_faces = nullptr;
+            int instance_source = model_instance_sources[model_index];
+            if(instance_source >= 0)
             {
-                const fr::face_3d& face = model_faces[index];
-                if(! face_vertices_are_visible(face, model_projected_vertices_valid))
+                if(instance_vertex_offsets[instance_source] < 0 &&
+                   instanced_vertices_count + model_vertices_count <= _max_instanced_vertices &&
+                   instanced_faces_count + model_render_items_count <= _max_instanced_faces)
                 {
-                    continue;
-                }
-                fr::point_3d centroid = model.transform(face.centroid());
-                fr::point_3d normal = model.rotate(face.normal());
-                fr::point_3d vr = centroid - camera_position;
-                bool front_facing = vr.safe_dot_product(normal) < 0;
-                int color_index = face.color_index();
-                bool room_floor_surface = color_index >= 0 && color_index <= 5;
-                bool room_shell_surface = color_index >= 6 && color_index <= 8;
-                bool room_main_wall_surface = color_index == 6;
-                bool room_perspective_mode = model.layering_mode() == Model::LayeringMode::room_perspective;
-                bool room_floor_only_mode = model.layering_mode() == Model::LayeringMode::room_floor_only;
-                bool near_shell_surface = room_perspective_mode && room_shell_surface &&
-                                          normal.y() < room_near_wall_cull_normal_y_max;
-                bool render_face = false;
-                if(room_floor_surface)
-                {
-                    render_face = (room_perspective_mode || room_floor_only_mode) && front_facing;
+                    RotatedPoint* rotated_vertices = instanced_vertices + instanced_vertices_count;
+                    ClassifiedFace* classified_faces = instanced_faces + instanced_faces_count;
+                    for(int index = 0; index < model_vertices_count; ++index)
+                    {
+                        rotate_model_point(model_view_matrix, model_vertices[index].point(), rotated_vertices[index]);
+                    }
+                    for(int index = 0; index < model_render_items_count; ++index)
+                    {
+                        bool floor_item = index == model_faces_count;
+                        const fr::face_3d& face = floor_item ? model.floor_item()->face() : model_faces[index];
+                        classify_face(model, face, floor_item, model_y_axis, classified_faces[index]);
+                    }
+                    instance_vertex_offsets[instance_source] = instanced_vertices_count;
+                    instance_face_offsets[instance_source] = instanced_faces_count;
+                    instanced_vertices_count += model_vertices_count;
+                    instanced_faces_count += model_render_items_count;
                 }
-                else if(room_shell_surface && room_floor_only_mode)
+                if(instance_vertex_offsets[instance_source] >= 0)
                 {
-                    render_face = false;
+                    model_rotated_vertices = instanced_vertices + instance_vertex_offsets[instance_source];
+                    model_classified_faces = instanced_faces + instance_face_offsets[instance_source];
                 }
-                else if(near_shell_surface)
+            }
+            if(model_rotated_vertices)
+            {
+                if(model_inside)
                 {
-                    render_face = false;
+                    for(int index = 0; index < model_vertices_count; ++index)
+                    {
+                        const RotatedPoint& rotated = model_rotated_vertices[index];
+                        project_visible_rotated_point(model_view_matrix, rotated,
+                                                      rotated_point_depth(model_view_matrix, rotated),
+                                                      model_projected_vertices[index]);
+                        model_projected_vertices_valid[index] = true;
+                    }
                 }
                 else
                 {
-                    bool allow_double_sided = model_double_sided;
-                    if(room_shell_surface)
+                    for(int index = 0; index < model_vertices_count; ++index)
                     {
-                        allow_double_sided = room_main_wall_surface;
+                        model_projected_vertices_valid[index] = project_rotated_point(
+                            model_view_matrix, model_rotated_vertices[index], model_projected_vertices[index]);
                     }
-                    render_face = front_facing || allow_double_sided;
                 }
-                if(! render_face)
-                {
-                    continue;
-                }
-                int projected_depth = -vr.y().data() + model.depth_bias();
-                if(room_perspective_mode)
-                {
-                    projected_depth += near_shell_surface ? room_front_layer_bias : room_back_layer_bias;
-                }
-                valid_faces_info[valid_faces_count] = {
-                    &face, model_projected_vertices, projected_depth
-                };
-                ++valid_faces_count;
             }
-            global_vertex_index += model_vertices_count;
-        }
-        RV_PROFILER_STOP();
-        RV_PROFILER_START("cull_valid_faces");
-        for(int face_index = valid_faces_count - 1; face_index >= 0; --face_index)
-        {
-            const ProjectedFace& projected_face = valid_faces_info[face_index];
-            const fr::face_3d* face = projected_face.face;
-            const ScreenPoint* model_projected_vertices = projected_face.projected_vertices;
-            const ScreenPoint& pv0 = model_projected_vertices[face->first_vertex_index()];
-            const ScreenPoint& pv1 = model_projected_vertices[face->second_vertex_index()];
-            const ScreenPoint& pv2 = model_projected_vertices[face->third_vertex_index()];
-            const ScreenPoint& pv3 = model_projected_vertices[face->fourth_vertex_index()];
-            int16_t minimum_x = pv0.x;
-            int16_t maximum_x = minimum_x;
-            auto min_max_x = [&minimum_x, &maximum_x](int16_t value)
+            else if(model_inside)
             {
-                if(value < minimum_x)
+                for(int index = 0; index < model_vertices_count; ++index)
                 {
-                    minimum_x = value;
+                    RotatedPoint rotated;
+                    rotate_model_point(model_view_matrix, model_vertices[index].point(), rotated);
+                    project_visible_rotated_point(model_view_matrix, rotated,
+                                                  rotated_point_depth(model_view_matrix, rotated),
+                                                  model_projected_vertices[index]);
+                    model_projected_vertices_valid[index] = true;
                 }
-                else if(value > maximum_x)
+            }
+            else
+            {
+                for(int index = 0; index < model_vertices_count; ++index)
                 {
-                    maximum_x = value;
+                    model_projected_vertices_valid[index] = project_model_point(
+                        model_view_matrix, model_vertices[index].point(), model_projected_vertices[index]);
                 }
-            };
-            min_max_x(pv1.x);
-            min_max_x(pv2.x);
-            min_max_x(pv3.x);
-            if(minimum_x >= display_width || maximum_x < 0)
+            }
+            for(int index = 0, limit = model.edges_count(); index < limit; ++index)
             {
-                continue;
+                model_edge_deltas[index] = invalid_edge_delta;
             }
-            auto tri_area2 = [](const ScreenPoint& a, const ScreenPoint& b, const ScreenPoint& c) {
-                return (b.x - a.x) * (c.y - a.y) - (b.y - a.y) * (c.x - a.x);
-            };
-            auto same_sign = [](int a, int b) {
-                return (a > 0 && b > 0) || (a < 0 && b < 0);
-            };
-            bool stable_projection = true;
-            if(face->triangle())
+            fr::point_3d model_camera_position = model.inverse_transform(camera_position);
+            int model_view_y = (model.position().y() - camera_position.y()).data();
+            const ProjectedFloor* model_projected_floor = nullptr;
+            if(model.floor_item())
             {
-                stable_projection = bn::abs(tri_area2(pv0, pv1, pv2)) >= projected_face_min_area2;
+                const fr::face_3d& face = model.floor_item()->face();
+                if((model_inside || face_vertices_are_visible(face, model_projected_vertices_valid)) &&
+                   project_floor(model, model_view_matrix, projected_floors[model_index]))
+                {
+                    model_projected_floor = &projected_floors[model_index];
+                }
             }
-            else
+            for(int index = model_render_items_count - 1; index >= 0; --index)
             {
-                int area012 = tri_area2(pv0, pv1, pv2);
-                int area023 = tri_area2(pv0, pv2, pv3);
-                int edge12 = tri_area2(pv1, pv2, pv3);
-                int edge23 = tri_area2(pv2, pv3, pv0);
-                int edge30 = tri_area2(pv3, pv0, pv1);
-                stable_projection =
-                    bn::abs(area012) >= projected_face_min_area2 &&
-                    bn::abs(area023) >= projected_face_min_area2 &&
-                    same_sign(area012, area023) &&
-                    same_sign(area012, edge12) &&
-                    same_sign(edge12, edge23) &&
-                    same_sign(edge23, edge30);
-            }
-            if(! stable_projection)
+                bool floor_item = index == model_faces_count;
+                const fr::face_3d& face = floor_item ? model.floor_item()->face() : model_faces[index];
+                if(! model_inside && ! face_vertices_are_visible(face, model_projected_vertices_valid))
+                {
+                    continue;
+                }
+                ClassifiedFace classified_face;
+                if(model_classified_faces)
+                {
+                    classified_face = model_classified_faces[index];
+                }
+                else
+                {
+                    classify_face(model, face, floor_item, model_y_axis, classified_face);
+                }
+                if(classified_face.render_rule == FaceRenderRule::never)
+                {
+                    continue;
+                }
+                if(classified_face.render_rule == FaceRenderRule::front_facing &&
+                   (face.centroid().point() - model_camera_position).safe_dot_product(face.normal().point()) >= 0)
+                {
+                    continue;
+                }
+                int projected_depth = -(classified_face.centroid_view_y + model_view_y) + model.depth_bias();
+                model_valid_faces[model_valid_faces_count] = {
+                    &face, model_projected_vertices, model.face_edge_indexes(index), model_edge_deltas,
+                    floor_item ? model_projected_floor : nullptr, projected_depth, classified_face.layer
+                };
+                ++model_valid_faces_count;
+            }
+            model_valid_faces_counts[model_index] = model_valid_faces_count;
+        }
+        RV_PROFILER_STOP();
+        RV_PROFILER_START("cull_valid_faces");
+        for(int model_index = 0; model_index < models_count; ++model_index)
+        {
+            if(! models_dirty[model_index])
             {
                 continue;
             }
-            int16_t minimum_y = pv0.y;
-            int16_t maximum_y = minimum_y;
-            int top_vertex_index = 0;
-            auto min_max_y = [&minimum_y, &maximum_y, &top_vertex_index](int index, int16_t value)
+            int model_face_offset = model_face_offsets[model_index];
+            const ProjectedFace* model_valid_faces = valid_faces_info + model_face_offset;
+            VisibleRenderItem* model_visible_faces = visible_faces + model_face_offset;
+            int* model_visible_face_projected_zs = visible_face_projected_zs + model_face_offset;
+            RenderLayer* model_visible_face_layers = visible_face_layers + model_face_offset;
+            int model_visible_faces_count = 0;
+            for(int face_index = model_valid_faces_counts[model_index] - 1; face_index >= 0; --face_index)
             {
-                if(value < minimum_y)
+                const ProjectedFace& projected_face = model_valid_faces[face_index];
+                const fr::face_3d* face = projected_face.face;
+                const ScreenPoint* model_projected_vertices = projected_face.projected_vertices;
+                const ScreenPoint& pv0 = model_projected_vertices[face->first_vertex_index()];
+                const ScreenPoint& pv1 = model_projected_vertices[face->second_vertex_index()];
+                const ScreenPoint& pv2 = model_projected_vertices[face->third_vertex_index()];
+                const ScreenPoint& pv3 = model_projected_vertices[face->fourth_vertex_index()];
+                int16_t minimum_x = pv0.x;
+                int16_t maximum_x = minimum_x;
+                auto min_max_x = [&minimum_x, &maximum_x](int16_t value)
+                {
+                    if(value < minimum_x)
+                    {
+                        minimum_x = value;
+                    }
+                    else if(value > maximum_x)
+                    {
+                        maximum_x = value;
+                    }
+                };
+                min_max_x(pv1.x);
+                min_max_x(pv2.x);
+                min_max_x(pv3.x);
+                if(minimum_x >= display_width || maximum_x < 0)
+                {
+                    continue;
+                }
+                auto tri_area2 = [](const ScreenPoint& a, const ScreenPoint& b, const ScreenPoint& c) {
+                    return (b.x - a.x) * (c.y - a.y) - (b.y - a.y) * (c.x - a.x);
+                };
+                auto same_sign = [](int a, int b) {
+                    return (a > 0 && b > 0) || (a < 0 && b < 0);
+                };
+                bool stable_projection = true;
+                if(face->triangle())
                 {
-                    top_vertex_index = index;
-                    minimum_y = value;
+                    stable_projection = bn::abs(tri_area2(pv0, pv1, pv2)) >= projected_face_min_area2;
                 }
-                else if(value > maximum_y)
+                else
                 {
-                    maximum_y = value;
+                    int area012 = tri_area2(pv0, pv1, pv2);
+                    int area023 = tri_area2(pv0, pv2, pv3);
+                    int edge12 = tri_area2(pv1, pv2, pv3);
+                    int edge23 = tri_area2(pv2, pv3, pv0);
+                    int edge30 = tri_area2(pv3, pv0, pv1);
+                    stable_projection =
+                        bn::abs(area012) >= projected_face_min_area2 &&
+                        bn::abs(area023) >= projected_face_min_area2 &&
+                        same_sign(area012, area023) &&
+                        same_sign(area012, edge12) &&
+                        same_sign(edge12, edge23) &&
+                        same_sign(edge23, edge30);
                 }
-            };
-            min_max_y(1, pv1.y);
-            min_max_y(2, pv2.y);
-            min_max_y(3, pv3.y);
-            if(minimum_y >= display_height || maximum_y < 0)
-            {
-                continue;
+                if(! stable_projection)
+                {
+                    continue;
+                }
+                int16_t minimum_y = pv0.y;
+                int16_t maximum_y = minimum_y;
+                int top_vertex_index = 0;
+                auto min_max_y = [&minimum_y, &maximum_y, &top_vertex_index](int index, int16_t value)
+                {
+                    if(value < minimum_y)
+                    {
+                        top_vertex_index = index;
+                        minimum_y = value;
+                    }
+                    else if(value > maximum_y)
+                    {
+                        maximum_y = value;
+                    }
+                };
+                min_max_y(1, pv1.y);
+                min_max_y(2, pv2.y);
+                min_max_y(3, pv3.y);
+                if(minimum_y >= display_height || maximum_y < 0)
+                {
+                    continue;
+                }
+                model_visible_faces[model_visible_faces_count] = {
+                    &projected_face, top_vertex_index, minimum_x, maximum_x, minimum_y, maximum_y
+                };
+                model_visible_face_projected_zs[model_visible_faces_count] = projected_face.projected_depth;
+                model_visible_face_layers[model_visible_faces_count] = projected_face.layer;
+                ++model_visible_faces_count;
             }
-            visible_faces[visible_faces_count] = {
-                &projected_face, top_vertex_index, minimum_x, maximum_x, minimum_y, maximum_y
-            };
-            visible_face_projected_zs[visible_faces_count] = projected_face.projected_depth;
-            visible_face_indexes[visible_faces_count] = uint8_t(visible_faces_count);
-            ++visible_faces_count;
+            _cached_models[model_index] = models[model_index];
+            _cached_model_versions[model_index] = models[model_index]->version();
+            _cached_model_visible_item_counts[model_index] = model_visible_faces_count;
         }
         RV_PROFILER_STOP();
         _cached_camera_position = camera_position;
         _cached_camera_yaw = camera_yaw;
         _cached_models_revision = _models_revision;
-        _cached_geometry_visible_item_count = visible_faces_count;
-        int cached_model_index = 0;
-        for(const Model& model : _models_list)
-        {
-            _cached_models[cached_model_index] = &model;
-            _cached_model_versions[cached_model_index] = model.version();
-            ++cached_model_index;
-        }
-        _cached_models_count = cached_model_index;
         _geometry_cache_valid = true;
     }
-    else
+    if(! geometry_cache_hit || ! _sprites_list.empty())
     {
-        visible_faces_count = _cached_geometry_visible_item_count;
-        if(! _sprites_list.empty())
+        for(int model_index = models_count - 1; model_index >= 0; --model_index)
         {
-            for(int visible_face_index = 0; visible_face_index < visible_faces_count; ++visible_face_index)
+            int model_face_offset = model_face_offsets[model_index];
+            int model_visible_faces_count = _cached_model_visible_item_counts[model_index];
+            for(int index = 0; index < model_visible_faces_count; ++index)
             {
-                visible_face_indexes[visible_face_index] = uint8_t(visible_face_index);
+                unsorted_visible_face_indexes[visible_faces_count] = face_index_type(model_face_offset + index);
+                ++visible_faces_count;
             }
         }
+        _cached_geometry_visible_item_count = visible_faces_count;
     }
-    RV_PROFILER_START("sprites");
-    for(Sprite& sprite : _sprites_list)
+    else
+    {
+        visible_faces_count = _cached_geometry_visible_item_count;
+    }
+    VisibleRenderItem* sprite_items = visible_faces + _model_faces_count;
+    int* sprite_projected_zs = visible_face_projected_zs + _model_faces_count;
+    RenderLayer* sprite_layers = visible_face_layers + _model_faces_count;
+    int sprite_items_count = 0;
+    const Sprite* sprite_sources[max_sprites];
+    int sprite_xs[max_sprites];
+    auto project_billboard = [&](const fr::point_3d& position, int half_canvas_size, bn::fixed scale,
+                                 int& x, int& y, int& depth, int& affine_scale_key)
     {
-        const fr::point_3d& sprite_position = sprite.position();
-        bn::fixed vry = sprite_position.y() - camera_position.y();
+        bn::fixed vry = position.y() - camera_position.y();
         int vcz = -vry.data();
         int div_lut_index = vcz >> 10;
         if(near_plane > vcz || div_lut_index > div_lut_max_index)
         {
-            continue;
+            return false;
         }
-        SpriteItem& sprite_item = sprite.item();
-        int sprite_px_size = sprite_item.width();
-        int canvas_size = sprite_px_size * 2;
-        bn::fixed vrx = (sprite_position.x() - camera_position.x()) / 16;
-        bn::fixed vrz = (sprite_position.z() - camera_position.z()) / 16;
+        int canvas_size = half_canvas_size * 2;
+        bn::fixed vrx = (position.x() - camera_position.x()) / 16;
+        bn::fixed vrz = (position.z() - camera_position.z()) / 16;
         int vcx = (vrx.unsafe_multiplication(camera_u_x) + vrz.unsafe_multiplication(camera_u_z)).data();
         int sprite_scale = int((fr::div_lut_ptr[div_lut_index] << (focal_length_shift - 8)) >> 3);
-        int scale = sprite_scale >> 3;
-        int sprite_x = ((vcx * scale) >> 16) + (display_width / 2) - sprite_px_size;
-        if(sprite_x >= display_width || sprite_x + canvas_size <= 0)
+        int projected_scale = sprite_scale >> 3;
+        x = ((vcx * projected_scale) >> 16) + (display_width / 2) - half_canvas_size;
+        if(x >= display_width || x + canvas_size <= 0)
         {
-            continue;
+            return false;
         }
         int vcy = -(vrx.unsafe_multiplication(camera_v_x) + vrz.unsafe_multiplication(camera_v_z)).data();
-        int sprite_y = ((vcy * scale) >> 16) + (display_height / 2) - sprite_px_size;
-        if(sprite_y >= display_height || sprite_y + canvas_size <= 0)
+        y = ((vcy * projected_scale) >> 16) + (display_height / 2) - half_canvas_size;
+        if(y >= display_height || y + canvas_size <= 0)
         {
-            continue;
+            return false;
         }
-        bn::fixed affine_scale = bn::fixed::from_data(sprite_scale).unsafe_multiplication(sprite.scale());
-        if(affine_scale <= 0)
+        bn::fixed affine_scale = bn::fixed::from_data(sprite_scale).unsafe_multiplication(scale);
+        affine_scale_key = affine_scale.data() >> SpriteAffineMatPool::scale_shift;
+        depth = vcz;
+        return affine_scale_key > 0;
+    };
+    auto billboard_bucket = [](int depth)
+    {
+        return bn::min(bn::max(depth - near_plane, 0) >> _billboard_bucket_shift, _billboard_buckets_count - 1);
+    };
+    RV_PROFILER_START("sprites");
+    for(Sprite& sprite : _sprites_list)
+    {
+        SpriteItem& sprite_item = sprite.item();
+        int sprite_x;
+        int sprite_y;
+        int vcz;
+        int affine_scale_key;
+        if(! project_billboard(sprite.position(), sprite_item.width(), sprite.scale(),
+                               sprite_x, sprite_y, vcz, affine_scale_key))
         {
             continue;
         }
-        int degrees = camera_yaw.shift_integer() * 360;
-        bn::fixed rotation_angle = bn::fixed::from_data(degrees >> 4);
-        if(rotation_angle >= 360)
-        {
-            rotation_angle -= 360;
-        }
-        bn::sprite_affine_mat_ptr& affine_mat = sprite_item.affine_mat();
-        affine_mat.set_scale(affine_scale);
-        affine_mat.set_rotation_angle(rotation_angle);
-        affine_mat.set_horizontal_flip(sprite.horizontal_flip());
+        int canvas_size = sprite_item.width() * 2;
         int attr0 = bn::hw::sprites::first_attributes(
                     sprite_y, bn::sprite_shape::SQUARE, bn::bpp_mode::BPP_4, 3 << 8,
                     false, false, false, false);
-        int attr1 = bn::hw::sprites::second_attributes(
-                    sprite_x, sprite_item.size(), sprite_item.affine_mat_id());
         int attr2 = bn::hw::sprites::third_attributes(
                     sprite_item.tiles_id(), sprite_item.palette_id(), 3);
-        visible_faces[visible_faces_count] = {
-            nullptr, sprite_y, int16_t(attr0), int16_t(attr1), int16_t(attr2), int16_t(canvas_size)
+        sprite_items[sprite_items_count] = {
+            nullptr, sprite_y, int16_t(attr0), 0, int16_t(attr2), int16_t(canvas_size)
         };
-        visible_face_projected_zs[visible_faces_count] = vcz;
-        visible_face_indexes[visible_faces_count] = uint8_t(visible_faces_count);
+        affine_mat_keys[sprite_items_count] = { affine_scale_key, 0, sprite.horizontal_flip() };
+        sprite_projected_zs[sprite_items_count] = vcz;
+        sprite_sources[sprite_items_count] = &sprite;
+        sprite_xs[sprite_items_count] = sprite_x;
+        sprite_layers[sprite_items_count] = RenderLayer::dynamic;
+        unsorted_visible_face_indexes[visible_faces_count] = face_index_type(_model_faces_count + sprite_items_count);
+        ++sprite_items_count;
         ++visible_faces_count;
     }
+    int billboards_count = 0;
+    for(BillboardBatch& billboard_batch : _billboard_batches_list)
+    {
+        billboard_batch.begin_frame_tiles();
+        int half_canvas_size = billboard_batch.width();
+        for(int index = 0, limit = billboard_batch.size(); index < limit; ++index)
+        {
+            int x;
+            int y;
+            int depth;
+            int affine_scale_key;
+            if(! project_billboard(billboard_batch.position(index), half_canvas_size, billboard_batch.scale(index),
+                                   x, y, depth, affine_scale_key))
+            {
+                continue;
+            }
+            int frame_tiles_index = billboard_batch.frame_tiles_index(billboard_batch.frame(index));
+            if(frame_tiles_index < 0)
+            {
+                continue;
+            }
+            int palette_index = billboard_batch.palette_index(index);
+            int attr0 = bn::hw::sprites::first_attributes(
+                        y, bn::sprite_shape::SQUARE, bn::bpp_mode::BPP_4, 3 << 8, false, false, false, false);
+            int attr2 = bn::hw::sprites::third_attributes(
+                        billboard_batch.frame_tiles_id(frame_tiles_index), billboard_batch.palette_id(palette_index),
+                        3);
+            projected_billboards[billboards_count] = {
+                &billboard_batch, depth, int16_t(x), int16_t(y), uint16_t(attr0), 0, uint16_t(attr2),
+                uint8_t(half_canvas_size * 2), uint8_t(frame_tiles_index), uint8_t(palette_index), 0,
+                uint8_t(billboard_bucket(depth))
+            };
+            affine_mat_keys[sprite_items_count + billboards_count] = {
+                affine_scale_key, 0, billboard_batch.horizontal_flip(index)
+            };
+            ++billboards_count;
+        }
+    }
+    int affine_mat_keys_count = sprite_items_count + billboards_count;
+    if(affine_mat_keys_count)
+    {
+        int degrees = camera_yaw.shift_integer() * 360;
+        bn::fixed rotation_angle = bn::fixed::from_data(degrees >> 4);
+        if(rotation_angle >= 360)
+        {
+            rotation_angle -= 360;
+        }
+        for(int key_index = 0; key_index < affine_mat_keys_count; ++key_index)
+        {
+            affine_mat_keys[key_index].rotation = rotation_angle.data();
+        }
+        _sprite_affine_mats.assign(affine_mat_keys, affine_mat_keys_count, affine_mat_indexes);
+        for(int sprite_index = 0; sprite_index < sprite_items_count; ++sprite_index)
+        {
+            int affine_mat_id = _sprite_affine_mats.affine_mat_id(affine_mat_indexes[sprite_index]);
+            sprite_items[sprite_index].maximum_x = int16_t(bn::hw::sprites::second_attributes(
+                        sprite_xs[sprite_index], sprite_sources[sprite_index]->item().size(), affine_mat_id));
+        }
+        for(int billboard_index = 0; billboard_index < billboards_count; ++billboard_index)
+        {
+            ProjectedBillboard& projected_billboard = projected_billboards[billboard_index];
+            int affine_mat_index = affine_mat_indexes[sprite_items_count + billboard_index];
+            projected_billboard.affine_mat_index = uint8_t(affine_mat_index);
+            projected_billboard.attr1 = uint16_t(bn::hw::sprites::second_attributes(
+                        projected_billboard.x, projected_billboard.batch->shape_size().size(),
+                        _sprite_affine_mats.affine_mat_id(affine_mat_index)));
+        }
+    }
     RV_PROFILER_STOP();
-    if(! visible_faces_count)
+    bool frame_unchanged = geometry_cache_hit && _frame_replay_valid &&
+                           sprite_items_count == _cached_sprite_render_items_count &&
+                           billboards_count == _cached_billboards_count;
+    for(int sprite_index = 0; sprite_index < sprite_items_count; ++sprite_index)
     {
-        return;
+        const VisibleRenderItem& sprite_item = sprite_items[sprite_index];
+        VisibleRenderItem& cached_sprite_item = _cached_sprite_render_items[sprite_index];
+        int projected_z = sprite_projected_zs[sprite_index];
+        if(frame_unchanged)
+        {
+            frame_unchanged = cached_sprite_item.top_vertex_index == sprite_item.top_vertex_index &&
+                              cached_sprite_item.minimum_x == sprite_item.minimum_x &&
+                              cached_sprite_item.maximum_x == sprite_item.maximum_x &&
+                              cached_sprite_item.minimum_y == sprite_item.minimum_y &&
+                              cached_sprite_item.maximum_y == sprite_item.maximum_y &&
+                              _cached_sprite_projected_zs[sprite_index] == projected_z;
+        }
+        cached_sprite_item = sprite_item;
+        _cached_sprite_projected_zs[sprite_index] = projected_z;
+    }
+    _cached_sprite_render_items_count = sprite_items_count;
+    for(int billboard_index = 0; billboard_index < billboards_count; ++billboard_index)
+    {
+        const ProjectedBillboard& projected_billboard = projected_billboards[billboard_index];
+        ProjectedBillboard& cached_billboard = _cached_billboards[billboard_index];
+        if(frame_unchanged)
+        {
+            frame_unchanged = cached_billboard.attr0 == projected_billboard.attr0 &&
+                              cached_billboard.attr1 == projected_billboard.attr1 &&
+                              cached_billboard.attr2 == projected_billboard.attr2 &&
+                              cached_billboard.bucket == projected_billboard.bucket;
+        }
+        cached_billboard = projected_billboard;
+    }
+    _cached_billboards_count = billboards_count;
+    _frame_replay_valid = true;
+    bool bake_impostor = false;
+    if(_shell_impostor.enabled())
+    {
+        if(shell_changed)
+        {
+            _shell_impostor.invalidate();
+            _impostor_settled_frames = 0;
+        }
+        else if(_impostor_settled_frames < _impostor_settle_frames)
+        {
+            ++_impostor_settled_frames;
+        }
+        bake_impostor = _impostor_settled_frames == _impostor_settle_frames &&
+                        ! _shell_impostor.valid() && ! _shell_impostor.failed();
+    }
+    if(frame_unchanged && ! bake_impostor)
+    {
+        return false;
+    }
+    if(! visible_faces_count && ! billboards_count)
+    {
+        _commit_oam_sprites(0);
+        return true;
     }
     if(! geometry_cache_hit || ! _sprites_list.empty())
     {
         RV_PROFILER_START("sort_visible_faces");
-        const int* projected_zs = visible_face_projected_zs;
-        bn::sort(visible_face_indexes, visible_face_indexes + visible_faces_count, [projected_zs](uint8_t a, uint8_t b)
+        int layer_offsets[render_layers_count];
+        int layer_counts[render_layers_count] = {};
+        for(int index = 0; index < visible_faces_count; ++index)
+        {
+            ++layer_counts[int(visible_face_layers[unsorted_visible_face_indexes[index]])];
+        }
+        int layer_offset = 0;
+        int previous_layer_offsets[render_layers_count];
+        int previous_layer_offset = 0;
+        for(int layer = 0; layer < render_layers_count; ++layer)
+        {
+            layer_offsets[layer] = layer_offset;
+            layer_offset += layer_counts[layer];
+            previous_layer_offsets[layer] = previous_layer_offset;
+            previous_layer_offset += _sorted_layer_item_counts[layer];
+        }
+        for(int index = 0; index < previous_layer_offset; ++index)
+        {
+            previous_visible_face_indexes[index] = visible_face_indexes[index];
+        }
+        int layer_write_offsets[render_layers_count];
+        for(int layer = 0; layer < render_layers_count; ++layer)
         {
-            int za = projected_zs[a];
-            int zb = projected_zs[b];
-            return za != zb ? za > zb : a < b;
-        });
+            layer_write_offsets[layer] = layer_offsets[layer];
+        }
+        for(int index = 0; index < visible_faces_count; ++index)
+        {
+            face_index_type face_index = unsorted_visible_face_indexes[index];
+            int layer = int(visible_face_layers[face_index]);
+            layered_visible_face_indexes[layer_write_offsets[layer]] = face_index;
+            ++layer_write_offsets[layer];
+        }
+        for(int layer = 0; layer < render_layers_count; ++layer)
+        {
+            const face_index_type* unsorted_layer_indexes = layered_visible_face_indexes + layer_offsets[layer];
+            face_index_type* sorted_layer_indexes = visible_face_indexes + layer_offsets[layer];
+            int layer_count = layer_counts[layer];
+            if(RenderLayer(layer) == RenderLayer::adjacent_room_floor || RenderLayer(layer) == RenderLayer::room_floor)
+            {
+                for(int index = 0; index < layer_count; ++index)
+                {
+                    sorted_layer_indexes[index] = unsorted_layer_indexes[index];
+                }
+            }
+            else if(layer_count)
+            {
+                temporal_depth_sort(previous_visible_face_indexes + previous_layer_offsets[layer],
+                                    _sorted_layer_item_counts[layer], unsorted_layer_indexes, sorted_layer_indexes,
+                                    radix_sort_visible_face_indexes, visible_face_indexes_pending, layer_count,
+                                    visible_face_projected_zs);
+            }
+            _sorted_layer_item_counts[layer] = layer_count;
+        }
         RV_PROFILER_STOP();
     }
     RV_PROFILER_START("render_visible_faces");
-    _scanline_renderer.begin_frame();
-    for(int visible_face_index = visible_faces_count - 1; visible_face_index >= 0; --visible_face_index)
+    _span_renderer.begin_frame();
+    _affine_floor_renderer.begin_frame();
+    bool impostor_valid = _shell_impostor.valid();
+    if(bake_impostor)
+    {
+        _shell_impostor.begin_bake();
+    }
+    int billboard_bucket_starts[_billboard_buckets_count + 1] = {};
+    for(int billboard_index = 0; billboard_index < billboards_count; ++billboard_index)
+    {
+        ++billboard_bucket_starts[projected_billboards[billboard_index].bucket + 1];
+    }
+    int billboard_bucket_offsets[_billboard_buckets_count];
+    for(int bucket = 0; bucket < _billboard_buckets_count; ++bucket)
+    {
+        billboard_bucket_starts[bucket + 1] += billboard_bucket_starts[bucket];
+        billboard_bucket_offsets[bucket] = billboard_bucket_starts[bucket];
+    }
+    for(int billboard_index = 0; billboard_index < billboards_count; ++billboard_index)
+    {
+        int& bucket_offset = billboard_bucket_offsets[projected_billboards[billboard_index].bucket];
+        billboard_render_order[bucket_offset] = uint16_t(billboard_index);
+        ++bucket_offset;
+    }
+    int dynamic_begin = 0;
+    for(int layer = 0; layer < int(RenderLayer::dynamic); ++layer)
+    {
+        dynamic_begin += _sorted_layer_item_counts[layer];
+    }
+    int dynamic_end = dynamic_begin + _sorted_layer_item_counts[int(RenderLayer::dynamic)];
+    constexpr int occupancy_rows = display_height / 8;
+    uint32_t occupied_columns[occupancy_rows] = {};
+    bool track_occupancy = SpanRenderer::hdma_sprites && (sprite_items_count || billboards_count);
+    auto occupancy_columns = [](int minimum_x, int maximum_x)
+    {
+        int first_column = bn::max(minimum_x, 0) >> 3;
+        int last_column = bn::min(maximum_x, display_width - 1) >> 3;
+        return first_column > last_column ? 0u : (2u << last_column) - (1u << first_column);
+    };
+    auto occupy = [&](int minimum_x, int minimum_y, int maximum_x, int maximum_y)
+    {
+        uint32_t columns = occupancy_columns(minimum_x, maximum_x);
+        for(int row = bn::max(minimum_y, 0) >> 3, last_row = bn::min(maximum_y, display_height - 1) >> 3;
+            row <= last_row; ++row)
+        {
+            occupied_columns[row] |= columns;
+        }
+    };
+    auto occupied = [&](int minimum_x, int minimum_y, int maximum_x, int maximum_y)
+    {
+        uint32_t columns = occupancy_columns(minimum_x, maximum_x);
+        for(int row = bn::max(minimum_y, 0) >> 3, last_row = bn::min(maximum_y, display_height - 1) >> 3;
+            row <= last_row; ++row)
+        {
+            if(occupied_columns[row] & columns)
+            {
+                return true;
+            }
+        }
+        return false;
+    };
+    int oam_sprites_count = 0;
+    auto add_billboard_sprite = [&](int x, int y, int canvas_size, uint16_t attr0, uint16_t attr1, uint16_t attr2,
+                                    const bn::sprite_shape_size& shape_size, const bn::sprite_tiles_ptr& tiles,
+                                    const bn::sprite_palette_ptr& palette, int affine_mat_index)
+    {
+        int maximum_x = x + canvas_size - 1;
+        int maximum_y = y + canvas_size - 1;
+        if(track_occupancy)
+        {
+            bool occluded = occupied(x, y, maximum_x, maximum_y);
+            occupy(x, y, maximum_x, maximum_y);
+            if(! occluded && oam_sprites_count < _max_oam_sprites)
+            {
+                _set_oam_sprite(oam_sprites_count, shape_size, tiles, palette, affine_mat_index, x, y);
+                ++oam_sprites_count;
+                return;
+            }
+        }
+        _span_renderer.add_sprite(unsigned(bn::max(y, 0)), unsigned(bn::min(maximum_y, display_height - 1)),
+                                  attr0, attr1, attr2);
+    };
+    int next_billboard_bucket = 0;
+    auto render_billboards = [&](int bucket_limit)
     {
+        for(; next_billboard_bucket < bucket_limit; ++next_billboard_bucket)
+        {
+            int bucket = SpanRenderer::front_to_back ?
+                        next_billboard_bucket : _billboard_buckets_count - 1 - next_billboard_bucket;
+            for(int order_index = billboard_bucket_starts[bucket], order_limit = billboard_bucket_starts[bucket + 1];
+                order_index < order_limit; ++order_index)
+            {
+                const ProjectedBillboard& projected_billboard =
+                        projected_billboards[billboard_render_order[order_index]];
+                const BillboardBatch& billboard_batch = *projected_billboard.batch;
+                add_billboard_sprite(projected_billboard.x, projected_billboard.y, projected_billboard.canvas_size,
+                                     projected_billboard.attr0, projected_billboard.attr1, projected_billboard.attr2,
+                                     billboard_batch.shape_size(),
+                                     billboard_batch.frame_tiles(projected_billboard.frame_tiles_index),
+                                     billboard_batch.palette(projected_billboard.palette_index),
+                                     projected_billboard.affine_mat_index);
+            }
+        }
+    };
+    for(int render_index = 0; render_index < visible_faces_count; ++render_index)
+    {
+        int visible_face_index = SpanRenderer::front_to_back ? visible_faces_count - 1 - render_index : render_index;
         const VisibleRenderItem& visible_face = visible_faces[visible_face_indexes[visible_face_index]];
+        if(billboards_count)
+        {
+            int billboard_bucket_limit;
+            if(visible_face_index >= dynamic_begin && visible_face_index < dynamic_end)
+            {
+                int bucket = billboard_bucket(visible_face_projected_zs[visible_face_indexes[visible_face_index]]);
+                billboard_bucket_limit = SpanRenderer::front_to_back ? bucket : _billboard_buckets_count - 1 - bucket;
+            }
+            else
+            {
+                bool before_dynamic = SpanRenderer::front_to_back ?
+                            visible_face_index >= dynamic_end : visible_face_index < dynamic_begin;
+                billboard_bucket_limit = before_dynamic ? 0 : _billboard_buckets_count;
+            }
+            render_billboards(billboard_bucket_limit);
+        }
         if(const ProjectedFace* projected_face = visible_face.projected_face)
         {
+            bool impostor_item = projected_face->layer != RenderLayer::dynamic &&
+                                 projected_face->layer != RenderLayer::room_front;
+            if(impostor_item && impostor_valid)
+            {
+                continue;
+            }
+            if(track_occupancy)
+            {
+                occupy(visible_face.minimum_x, visible_face.minimum_y, visible_face.maximum_x, visible_face.maximum_y);
+            }
+            bool bake_item = impostor_item && bake_impostor;
             const fr::face_3d* face = projected_face->face;
             int minimum_x = visible_face.minimum_x;
             int maximum_x = visible_face.maximum_x;
@@ -558,6 +2148,13 @@ void Renderer::_render_frame(const Camera& camera)
             {
                 continue;
             }
+            bool emit_spans = ! _span_renderer.span_coverage_enabled() ||
+                              ! _span_renderer.covered(bn::max(minimum_y, 0), bn::min(maximum_y, display_height - 1),
+                                                       minimum_x, maximum_x);
+            if(! emit_spans && ! bake_item)
+            {
+                continue;
+            }
             if(minimum_y != maximum_y)
             {
                 int y = minimum_y;
@@ -571,18 +2168,38 @@ void Renderer::_render_frame(const Camera& camera)
                 }
                 PolygonVertex vertices[4];
                 const ScreenPoint* model_projected_vertices = projected_face->projected_vertices;
+                const uint16_t* face_edge_indexes = projected_face->edge_indexes;
+                int* model_edge_deltas = projected_face->edge_deltas;
+                auto edge_delta = [model_edge_deltas](const PolygonVertex* top, const PolygonVertex* bottom,
+                                                      int edge_index)
+                {
+                    int delta_y = bottom->y - top->y;
+                    if(delta_y <= 0)
+                    {
+                        return fixed();
+                    }
+                    int& delta = model_edge_deltas[edge_index];
+                    if(delta == invalid_edge_delta)
+                    {
+                        delta = fr::unsafe_unsigned_lut_division<fixed_precision>(bottom->x - top->x, delta_y).data();
+                    }
+                    return fixed::from_data(delta);
+                };
                 const ScreenPoint& pv0 = model_projected_vertices[face->first_vertex_index()];
                 vertices[0].x = pv0.x;
                 vertices[0].y = pv0.y;
+                vertices[0].next_edge_index = face_edge_indexes[0];
                 vertices[0].next = &vertices[1];
                 const ScreenPoint& pv1 = model_projected_vertices[face->second_vertex_index()];
                 vertices[1].x = pv1.x;
                 vertices[1].y = pv1.y;
+                vertices[1].next_edge_index = face_edge_indexes[1];
                 vertices[1].prev = &vertices[0];
                 vertices[1].next = &vertices[2];
                 const ScreenPoint& pv2 = model_projected_vertices[face->third_vertex_index()];
                 vertices[2].x = pv2.x;
                 vertices[2].y = pv2.y;
+                vertices[2].next_edge_index = face_edge_indexes[2];
                 vertices[2].prev = &vertices[1];
                 if(face->triangle())
                 {
@@ -596,6 +2213,7 @@ void Renderer::_render_frame(const Camera& camera)
                     const ScreenPoint& pv3 = model_projected_vertices[face->fourth_vertex_index()];
                     vertices[3].x = pv3.x;
                     vertices[3].y = pv3.y;
+                    vertices[3].next_edge_index = face_edge_indexes[3];
                     vertices[3].prev = &vertices[2];
                     vertices[3].next = &vertices[0];
                 }
@@ -616,10 +2234,8 @@ void Renderer::_render_frame(const Camera& camera)
                 }
                 fixed xl = left_top->x;
                 fixed xr = right_top->x;
-                fixed left_delta = fr::unsafe_unsigned_lut_division<fixed_precision>(
-                            left_bottom->x - left_top->x, left_bottom->y - left_top->y);
-                fixed right_delta = fr::unsafe_unsigned_lut_division<fixed_precision>(
-                            right_bottom->x - right_top->x, right_bottom->y - right_top->y);
+                fixed left_delta = edge_delta(left_top, left_bottom, left_top->next_edge_index);
+                fixed right_delta = edge_delta(right_top, right_bottom, right_bottom->next_edge_index);
                 while(true)
                 {
                     int left_bottom_y = left_bottom->y;
@@ -675,8 +2291,7 @@ void Renderer::_render_frame(const Camera& camera)
                             left_bottom = left_bottom->next;
                             delta_y = left_bottom->y - left_top->y;
                         }
-                        left_delta = fr::unsafe_unsigned_lut_division<fixed_precision>(
-                                    left_bottom->x - left_top->x, delta_y);
+                        left_delta = edge_delta(left_top, left_bottom, left_top->next_edge_index);
                         xl = left_top->x + left_delta;
                     }
                     if(bottom_y == right_bottom_y)
@@ -690,8 +2305,7 @@ void Renderer::_render_frame(const Camera& camera)
                             right_bottom = right_bottom->prev;
                             delta_y = right_bottom->y - right_top->y;
                         }
-                        right_delta = fr::unsafe_unsigned_lut_division<fixed_precision>(
-                                    right_bottom->x - right_top->x, delta_y);
+                        right_delta = edge_delta(right_top, right_bottom, right_bottom->next_edge_index);
                         xr = right_top->x + right_delta;
                     }
                 }
@@ -706,28 +2320,246 @@ void Renderer::_render_frame(const Camera& camera)
                 }
                 hlines[minimum_y] = { hline_xl, hline_xr };
             }
+            if(const ProjectedFloor* projected_floor = projected_face->projected_floor)
+            {
+                if(bake_item)
+                {
+                    _render_floor(_shell_impostor, *projected_floor, unsigned(minimum_y), unsigned(maximum_y),
+                                  face->shading(), hlines);
+                }
+                if(emit_spans &&
+                   (projected_face->layer != RenderLayer::room_floor ||
+                    ! _affine_floor_renderer.add_floor(*projected_floor->item, face->shading(),
+                                                       projected_floor->screen_matrix,
+                                                       unsigned(minimum_y), unsigned(maximum_y), hlines)))
+                {
+                    _render_floor(_span_renderer, *projected_floor, unsigned(minimum_y), unsigned(maximum_y),
+                                  face->shading(), hlines);
+                }
+                continue;
+            }
             int width = maximum_x - minimum_x + 1;
-            _scanline_renderer.add_scanline_spans(unsigned(minimum_y), unsigned(maximum_y), width, x_outside,
+            if(bake_item)
+            {
+                _shell_impostor.add_scanline_spans(unsigned(minimum_y), unsigned(maximum_y), width, x_outside,
+                                                   face->color_index(), face->shading(), hlines);
+            }
+            if(emit_spans)
+            {
+                _span_renderer.add_scanline_spans(unsigned(minimum_y), unsigned(maximum_y), width, x_outside,
                                                   face->color_index(), face->shading(), hlines);
+            }
         }
         else
         {
-            int minimum_y = visible_face.top_vertex_index;
-            int maximum_y = minimum_y + visible_face.maximum_y - 1;
-            if(minimum_y < 0)
+            int sprite_index = visible_face_indexes[visible_face_index] - _model_faces_count;
+            const SpriteItem& sprite_item = sprite_sources[sprite_index]->item();
+            add_billboard_sprite(sprite_xs[sprite_index], visible_face.top_vertex_index, visible_face.maximum_y,
+                                 visible_face.minimum_x, visible_face.maximum_x, visible_face.minimum_y,
+                                 sprite_item.shape_size(), sprite_item.tiles(), sprite_item.palette(),
+                                 affine_mat_indexes[sprite_index]);
+        }
+    }
+    render_billboards(_billboard_buckets_count);
+    _commit_oam_sprites(oam_sprites_count);
+    if(bake_impostor)
+    {
+        _shell_impostor.finish_bake();
+    }
+    RV_PROFILER_STOP();
+    return true;
+}
+void BitmapRenderer::begin_frame()
+{
+    _frame_active = true;
+    _sprites_count = 0;
+    _dropped_sprites_count = 0;
+    constexpr int line_elements = bn::display::width() / 2;
+    int back_page = _front_page ^ 1;
+    int minimum_y = _drawn_minimum_ys[back_page];
+    int maximum_y = _drawn_maximum_ys[back_page];
+    if(minimum_y <= maximum_y)
+    {
+        bn::memory::clear((maximum_y - minimum_y + 1) * line_elements, _back_page[minimum_y * line_elements]);
+    }
+    _drawn_minimum_ys[back_page] = bn::display::height();
+    _drawn_maximum_ys[back_page] = -1;
+}
+void ShellImpostor::add_scanline_spans(
+        unsigned minimum_y, unsigned maximum_y, int, bool, int color_index, unsigned shading,
+        const ScanlineSpan* scanline_spans)
+{
+    for(unsigned y = minimum_y; y <= maximum_y; ++y)
+    {
+        _fill_scanline_span(y, scanline_spans[y].left_x, scanline_spans[y].right_x, color_index, shading);
+    }
+}
+void ShellImpostor::add_scanline_span(unsigned y, int left_x, int right_x, int color_index, unsigned shading)
+{
+    _fill_scanline_span(y, left_x, right_x, color_index, shading);
+}
+void ShellImpostor::_fill_scanline_span(unsigned y, int left_x, int right_x, int color_index, unsigned shading)
+{
+    left_x = bn::max(left_x, 0);
+    right_x = bn::min(right_x, bn::display::width() - 1);
+    uint8_t color = uint8_t((shading * fr::face_3d::max_colors) + unsigned(color_index) + 1);
+    uint8_t* line = _buffers->pixels[y];
+    for(int x = left_x; x <= right_x; ++x)
+    {
+        if(! line[x])
+        {
+            line[x] = color;
+        }
+    }
+}
+void BitmapRenderer::add_scanline_spans(
+        unsigned minimum_y, unsigned maximum_y, int, bool, int color_index, unsigned shading,
+        const ScanlineSpan* scanline_spans)
+{
+    int back_page = _front_page ^ 1;
+    _drawn_minimum_ys[back_page] = bn::min(_drawn_minimum_ys[back_page], int(minimum_y));
+    _drawn_maximum_ys[back_page] = bn::max(_drawn_maximum_ys[back_page], int(maximum_y));
+    for(unsigned y = minimum_y; y <= maximum_y; ++y)
+    {
+        _fill_scanline_span(y, scanline_spans[y].left_x, scanline_spans[y].right_x, color_index, shading);
+    }
+}
+void BitmapRenderer::add_scanline_span(unsigned y, int left_x, int right_x, int color_index, unsigned shading)
+{
+    int back_page = _front_page ^ 1;
+    _drawn_minimum_ys[back_page] = bn::min(_drawn_minimum_ys[back_page], int(y));
+    _drawn_maximum_ys[back_page] = bn::max(_drawn_maximum_ys[back_page], int(y));
+    _fill_scanline_span(y, left_x, right_x, color_index, shading);
+}
+void BitmapRenderer::_fill_scanline_span(unsigned y, int left_x, int right_x, int color_index, unsigned shading)
+{
+    left_x = bn::max(left_x, 0);
+    right_x = bn::min(right_x, bn::display::width() - 1);
+    if(left_x > right_x)
+    {
+        return;
+    }
+    unsigned color = (shading * fr::face_3d::max_colors) + unsigned(color_index) + 1;
+    uint16_t* line = _back_page + (y * (bn::display::width() / 2));
+    if(left_x & 1)
+    {
+        uint16_t& pixels = line[left_x >> 1];
+        pixels = uint16_t((pixels & 0x00FF) | (color << 8));
+        ++left_x;
+    }
+    if(! (right_x & 1) && right_x >= left_x)
+    {
+        uint16_t& pixels = line[right_x >> 1];
+        pixels = uint16_t((pixels & 0xFF00) | color);
+        --right_x;
+    }
+    int first_index = left_x >> 1;
+    int last_index = right_x >> 1;
+    if(first_index > last_index)
+    {
+        return;
+    }
+    uint16_t color_pair = uint16_t(color | (color << 8));
+    if(first_index & 1)
+    {
+        line[first_index] = color_pair;
+        ++first_index;
+    }
+    int pairs_count = last_index - first_index + 1;
+    uint32_t* words = reinterpret_cast<uint32_t*>(line + first_index);
+    uint32_t color_quad = color_pair | (uint32_t(color_pair) << 16);
+    for(int word_index = 0; word_index < pairs_count >> 1; ++word_index)
+    {
+        words[word_index] = color_quad;
+    }
+    if(pairs_count & 1)
+    {
+        line[last_index] = color_pair;
+    }
+}
+template<typename SpanSink>
+void Renderer::_render_floor(SpanSink& span_sink, const ProjectedFloor& projected_floor,
+                             unsigned minimum_y, unsigned maximum_y, unsigned shading,
+                             const ScanlineRenderer::ScanlineSpan* scanline_spans)
+{
+    constexpr int display_width = bn::display::width();
+    const TiledFloorItem& floor_item = *projected_floor.item;
+    int columns = floor_item.columns();
+    int rows = floor_item.rows();
+    int column_lines_count = columns - 1;
+    int lines_count = column_lines_count + rows - 1;
+    for(unsigned y = minimum_y; y <= maximum_y; ++y)
+    {
+        const ScanlineRenderer::ScanlineSpan& scanline_span = scanline_spans[y];
+        int left_x = bn::max(scanline_span.left_x, 0);
+        int right_x = bn::min(scanline_span.right_x, display_width - 1);
+        if(left_x > right_x)
+        {
+            continue;
+        }
+        FloorLineEvent events[_max_floor_lines];
+        int events_count = 0;
+        int column = 0;
+        int row = 0;
+        for(int line_index = 0; line_index < lines_count; ++line_index)
+        {
+            const FloorLine& floor_line = projected_floor.lines[line_index];
+            bool row_line = line_index >= column_lines_count;
+            int line_y = int(y) - floor_line.origin_y;
+            bool positive;
+            if(int direction = floor_line.direction)
+            {
+                int64_t line_x = floor_line.origin_x + (int64_t(line_y) * floor_line.slope);
+                int boundary_x = int((line_x + (1 << fixed_precision) - 1) >> fixed_precision);
+                positive = direction > 0 ? left_x >= boundary_x : left_x < boundary_x;
+                if(boundary_x > left_x && boundary_x <= right_x)
+                {
+                    FloorLineEvent event = {
+                        int16_t(boundary_x), int8_t(row_line ? 0 : direction), int8_t(row_line ? direction : 0)
+                    };
+                    int insert_index = events_count;
+                    while(insert_index > 0 && events[insert_index - 1].x > event.x)
+                    {
+                        events[insert_index] = events[insert_index - 1];
+                        --insert_index;
+                    }
+                    events[insert_index] = event;
+                    ++events_count;
+                }
+            }
+            else
+            {
+                positive = floor_line.side && floor_line.side * line_y >= 0;
+            }
+            if(positive)
             {
-                minimum_y = 0;
+                if(row_line)
+                {
+                    ++row;
+                }
+                else
+                {
+                    ++column;
+                }
             }
-            else if(maximum_y > display_height - 1)
+        }
+        int x = left_x;
+        for(int event_index = 0; event_index < events_count; ++event_index)
+        {
+            const FloorLineEvent& event = events[event_index];
+            if(event.x > x)
             {
-                maximum_y = display_height - 1;
+                int color_index = floor_item.tile_color(bn::max(bn::min(column, columns - 1), 0),
+                                                        bn::max(bn::min(row, rows - 1), 0));
+                span_sink.add_scanline_span(y, x, event.x - 1, color_index, shading);
+                x = event.x;
             }
-            uint16_t attr0 = visible_face.minimum_x;
-            uint16_t attr1 = visible_face.maximum_x;
-            uint16_t attr2 = visible_face.minimum_y;
-            _scanline_renderer.add_sprite(unsigned(minimum_y), unsigned(maximum_y), attr0, attr1, attr2);
+            column += event.column_delta;
+            row += event.row_delta;
         }
+        int color_index = floor_item.tile_color(bn::max(bn::min(column, columns - 1), 0),
+                                                bn::max(bn::min(row, rows - 1), 0));
+        span_sink.add_scanline_span(y, x, right_x, color_index, shading);
     }
-    RV_PROFILER_STOP();
 }
 }
@@ -1,12 +1,23 @@
 #include "private/viewer/str_room_renderer.h"
+#include "bn_affine_bg_item.h"
+#include "bn_affine_bg_map_item.h"
+#include "bn_affine_bg_tiles_item.h"
 #include "bn_assert.h"
+#include "bn_bg_palette_item.h"
+#include "bn_bg_palette_ptr.h"
 #include "bn_hdma.h"
+#include "bn_log.h"
 #include "bn_math.h"
 #include "bn_memory.h"
 #include "bn_profiler.h"
+#include "bn_rect_window.h"
+#include "bn_sprite_double_size_mode.h"
+#include "bn_regular_bg_map_item.h"
+#include "bn_regular_bg_tiles_item.h"
 #include "bn_sprite_palette_item.h"
 #include "bn_sprites.h"
 #include "bn_hw_sprites.h"
+#include "bn_window.h"
 #include "fr_sin_cos.h"
 #include "bn_sprite_tiles_items_shape_group_texture_1_8.h"
 #include "bn_sprite_tiles_items_shape_group_texture_1_16.h"
@@ -121,6 +132,15 @@ namespace
             &bn::sprite_tiles_items::shape_group_texture_10_64
         }
     };
+    constexpr uintptr_t bg2_affine_registers_address = 0x04000020;
+    constexpr int window_fill_vertical_offset = 48;
+    constexpr bn::fixed wide_span_horizontal_scales[] = { 2, 1.984375, 1.96875 };
+    constexpr uintptr_t display_control_address = 0x04000000;
+    constexpr uintptr_t bitmap_pages_address = 0x06000000;
+    constexpr uintptr_t bitmap_page_size = 0xA000;
+    constexpr uint16_t bitmap_display_control = 4 | (1 << 6) | (1 << 10) | (1 << 12);
+    constexpr uint16_t bitmap_page_select = 1 << 4;
+    constexpr int bitmap_reserved_sprite_tiles_count = 512;
     constexpr bn::color brightness_color(bn::color color, int brightness)
     {
         int red = (color.red() * brightness) / 32;
@@ -159,6 +179,103 @@ void Camera::set_yaw(bn::fixed yaw)
     _up_axis.set_x(s);
     _up_axis.set_z(-c);
 }
+Model::Model(const fr::model_3d_item& item, const TiledFloorItem* floor_item, const ModelBounds* bounds) :
+    _item(&item),
+    _floor_item(floor_item),
+    _bounds(bounds)
+{
+    int vertices_count = item.vertices().size();
+    BN_ASSERT(vertices_count <= max_vertices, "Too many model vertices: ", vertices_count);
+    int render_items_count = item.faces().size() + (floor_item ? 1 : 0);
+    BN_ASSERT(render_items_count <= max_faces, "Too many model faces: ", render_items_count);
+    int edges_count = _add_edges(item, floor_item, 0);
+    _reserved_vertices_count = uint16_t(vertices_count);
+    _reserved_render_items_count = uint16_t(render_items_count);
+    _reserved_edges_count = uint16_t(edges_count);
+    _lod_edges_counts[0] = uint16_t(edges_count);
+}
+Model::Model(const bn::span<const ModelLod>& lods, const ModelBounds& bounds) :
+    _item(&lods[0].item()),
+    _floor_item(nullptr),
+    _bounds(&bounds),
+    _lods(lods)
+{
+    int lods_count = lods.size();
+    BN_ASSERT(lods_count > 0 && lods_count <= max_lods, "Invalid LODs count: ", lods_count);
+    int vertices_count = _item->vertices().size();
+    int faces_count = _item->faces().size();
+    BN_ASSERT(vertices_count <= max_vertices, "Too many model vertices: ", vertices_count);
+    int face_offset = 0;
+    int reserved_edges_count = 0;
+    for(int lod_index = 0; lod_index < lods_count; ++lod_index)
+    {
+        const ModelLod& lod = lods[lod_index];
+        const fr::model_3d_item& lod_item = lod.item();
+        int lod_faces_count = lod_item.faces().size();
+        BN_ASSERT(lod_item.vertices().size() <= vertices_count, "Too many LOD vertices: ", lod_index);
+        BN_ASSERT(lod_faces_count <= faces_count, "Too many LOD faces: ", lod_index);
+        BN_ASSERT(! lod_index || lod.min_screen_radius() <= lods[lod_index - 1].min_screen_radius(),
+                  "LOD screen radius thresholds must decrease: ", lod_index);
+        BN_ASSERT(face_offset + lod_faces_count <= max_faces, "Too many model faces in LODs: ",
+                  face_offset + lod_faces_count);
+        int edges_count = _add_edges(lod_item, nullptr, face_offset);
+        _lod_face_offsets[lod_index] = uint16_t(face_offset);
+        _lod_edges_counts[lod_index] = uint16_t(edges_count);
+        reserved_edges_count = bn::max(reserved_edges_count, edges_count);
+        face_offset += lod_faces_count;
+    }
+    _reserved_vertices_count = uint16_t(vertices_count);
+    _reserved_render_items_count = uint16_t(faces_count);
+    _reserved_edges_count = uint16_t(reserved_edges_count);
+}
+int Model::_add_edges(const fr::model_3d_item& item, const TiledFloorItem* floor_item, int face_offset)
+{
+    static BN_DATA_EWRAM_BSS int16_t vertex_first_edges[max_vertices];
+    static BN_DATA_EWRAM_BSS int16_t next_vertex_edges[max_edges];
+    static BN_DATA_EWRAM_BSS RendererCapacities::vertex_index_type edge_second_vertexes[max_edges];
+    int vertices_count = item.vertices().size();
+    int faces_count = item.faces().size();
+    int render_items_count = faces_count + (floor_item ? 1 : 0);
+    for(int vertex_index = 0; vertex_index < vertices_count; ++vertex_index)
+    {
+        vertex_first_edges[vertex_index] = -1;
+    }
+    const fr::face_3d* faces = item.faces().data();
+    int edges_count = 0;
+    for(int face_index = 0; face_index < render_items_count; ++face_index)
+    {
+        const fr::face_3d& face = face_index < faces_count ? faces[face_index] : floor_item->face();
+        int face_vertex_indexes[4] = {
+            face.first_vertex_index(), face.second_vertex_index(), face.third_vertex_index(),
+            face.fourth_vertex_index()
+        };
+        int face_vertices_count = face.triangle() ? 3 : 4;
+        for(int edge_index = 0; edge_index < face_vertices_count; ++edge_index)
+        {
+            int first_vertex = face_vertex_indexes[edge_index];
+            int second_vertex = face_vertex_indexes[(edge_index + 1) % face_vertices_count];
+            if(first_vertex > second_vertex)
+            {
+                bn::swap(first_vertex, second_vertex);
+            }
+            int model_edge_index = vertex_first_edges[first_vertex];
+            while(model_edge_index >= 0 && edge_second_vertexes[model_edge_index] != second_vertex)
+            {
+                model_edge_index = next_vertex_edges[model_edge_index];
+            }
+            if(model_edge_index < 0)
+            {
+                model_edge_index = edges_count;
+                edge_second_vertexes[model_edge_index] = RendererCapacities::vertex_index_type(second_vertex);
+                next_vertex_edges[model_edge_index] = vertex_first_edges[first_vertex];
+                vertex_first_edges[first_vertex] = int16_t(model_edge_index);
+                ++edges_count;
+            }
+            _face_edge_indexes[face_offset + face_index][edge_index] = uint16_t(model_edge_index);
+        }
+    }
+    return edges_count;
+}
 void Model::set_rotation_matrix(
     bn::fixed xx, bn::fixed xy, bn::fixed xz,
     bn::fixed yx, bn::fixed yy, bn::fixed yz,
@@ -181,18 +298,176 @@ void Model::set_rotation_matrix(
 SpriteItem::SpriteItem(const bn::sprite_item& item, int graphics_index) :
     _shape_size(item.shape_size()),
     _tiles(item.tiles_item().create_tiles(graphics_index)),
-    _palette(item.palette_item().create_palette()),
-    _affine_mat(bn::sprite_affine_mat_ptr::create())
+    _palette(item.palette_item().create_palette())
 {
     BN_ASSERT(_shape_size.shape() == bn::sprite_shape::SQUARE, "Invalid shape");
     BN_ASSERT((_shape_size.width() == 32 || _shape_size.width() == 64) &&
               _shape_size.width() == item.shape_size().height(), "Invalid shape size");
     _tiles_id = _tiles.id();
     _palette_id = _palette.id();
-    _affine_mat_id = _affine_mat.id();
+}
+BillboardBatch::BillboardBatch(const bn::sprite_item& item) :
+    _item(item),
+    _shape_size(item.shape_size())
+{
+    BN_ASSERT(_shape_size.shape() == bn::sprite_shape::SQUARE, "Invalid shape");
+    BN_ASSERT(_shape_size.width() == 32 || _shape_size.width() == 64, "Invalid shape size");
+    add_palette(item.palette_item().create_palette());
+}
+int BillboardBatch::add_palette(const bn::sprite_palette_ptr& palette)
+{
+    BN_ASSERT(! _palettes.full(), "There's no space for more billboard palettes");
+    int palette_index = _palettes.size();
+    _palettes.push_back(palette);
+    _palette_ids[palette_index] = uint16_t(palette.id());
+    return palette_index;
+}
+int BillboardBatch::add(const fr::point_3d& position, bn::fixed scale, int frame)
+{
+    BN_ASSERT(! full(), "There's no space for more billboards");
+    int index = _size;
+    ++_size;
+    set_position(index, position);
+    set_scale(index, scale);
+    set_frame(index, frame);
+    _horizontal_flips[index] = false;
+    _palette_indexes[index] = 0;
+    return index;
+}
+void BillboardBatch::begin_frame_tiles()
+{
+    for(int index = 0, limit = _frame_tiles.size(); index < limit; ++index)
+    {
+        _frame_tiles_used[index] = false;
+    }
+}
+int BillboardBatch::frame_tiles_index(int frame)
+{
+    int frame_tiles_count = _frame_tiles.size();
+    int free_index = -1;
+    for(int index = 0; index < frame_tiles_count; ++index)
+    {
+        if(_frame_tiles_frames[index] == frame)
+        {
+            _frame_tiles_used[index] = true;
+            return index;
+        }
+        if(free_index < 0 && ! _frame_tiles_used[index])
+        {
+            free_index = index;
+        }
+    }
+    if(free_index >= 0)
+    {
+        _frame_tiles[free_index].set_tiles_ref(_item.tiles_item(), frame);
+    }
+    else if(! _frame_tiles.full())
+    {
+        free_index = frame_tiles_count;
+        _frame_tiles.push_back(_item.tiles_item().create_tiles(frame));
+    }
+    else
+    {
+        return -1;
+    }
+    _frame_tiles_frames[free_index] = uint16_t(frame);
+    _frame_tiles_ids[free_index] = uint16_t(_frame_tiles[free_index].id());
+    _frame_tiles_used[free_index] = true;
+    return free_index;
+}
+void SpriteAffineMatPool::assign(const Key* keys, int keys_count, uint8_t* indexes)
+{
+    constexpr uint8_t unassigned_index = 0xFF;
+    bool used[max_affine_mats] = {};
+    int affine_mats_count = _affine_mats.size();
+    _updates_count = 0;
+    for(int key_index = 0; key_index < keys_count; ++key_index)
+    {
+        indexes[key_index] = unassigned_index;
+        for(int index = 0; index < affine_mats_count; ++index)
+        {
+            if(_keys[index] == keys[key_index])
+            {
+                indexes[key_index] = uint8_t(index);
+                used[index] = true;
+                break;
+            }
+        }
+    }
+    for(int key_index = 0; key_index < keys_count; ++key_index)
+    {
+        if(indexes[key_index] != unassigned_index)
+        {
+            continue;
+        }
+        const Key& key = keys[key_index];
+        int free_index = -1;
+        for(int index = 0; index < affine_mats_count; ++index)
+        {
+            if(! used[index])
+            {
+                if(free_index < 0)
+                {
+                    free_index = index;
+                }
+            }
+            else if(_keys[index] == key)
+            {
+                free_index = index;
+                break;
+            }
+        }
+        if(free_index >= 0 && used[free_index])
+        {
+            indexes[key_index] = uint8_t(free_index);
+            continue;
+        }
+        if(free_index < 0 && _affine_mats.full())
+        {
+            int nearest_scale_delta = bn::numeric_limits<int>::max();
+            free_index = 0;
+            for(int index = 0; index < affine_mats_count; ++index)
+            {
+                const Key& used_key = _keys[index];
+                int scale_delta = bn::abs(used_key.scale - key.scale);
+                if(used_key.horizontal_flip != key.horizontal_flip)
+                {
+                    scale_delta += bn::numeric_limits<int>::max() / 2;
+                }
+                if(scale_delta < nearest_scale_delta)
+                {
+                    nearest_scale_delta = scale_delta;
+                    free_index = index;
+                }
+            }
+            BN_ASSERT(_affine_mat_ids[free_index] < max_affine_mat_ids, "Invalid fallback affine mat id: ",
+                      _affine_mat_ids[free_index]);
+            indexes[key_index] = uint8_t(free_index);
+            continue;
+        }
+        if(free_index < 0)
+        {
+            free_index = affine_mats_count;
+            _affine_mats.push_back(bn::sprite_affine_mat_ptr::create());
+            int affine_mat_id = _affine_mats.back().id();
+            BN_ASSERT(affine_mat_id < max_affine_mat_ids, "Affine mat overwritten by HDMA: ", affine_mat_id);
+            _affine_mat_ids[free_index] = uint8_t(affine_mat_id);
+            ++affine_mats_count;
+        }
+        bn::sprite_affine_mat_ptr& affine_mat = _affine_mats[free_index];
+        affine_mat.set_scale(bn::fixed::from_data(key.scale << scale_shift));
+        affine_mat.set_rotation_angle(bn::fixed::from_data(key.rotation));
+        affine_mat.set_horizontal_flip(key.horizontal_flip);
+        _keys[free_index] = key;
+        used[free_index] = true;
+        indexes[key_index] = uint8_t(free_index);
+        ++_updates_count;
+    }
 }
 ScanlineRenderer::ScanlineRenderer()
 {
+    bn::memory::clear(_hdma_source_size, _hdma_source_a[0]);
+    bn::memory::clear(_hdma_source_size, _hdma_source_b[0]);
     for(int index = 0; index < _hdma_source_size; index += 4)
     {
         bn::hw::sprites::hide(_hdma_source_a[index]);
@@ -263,41 +538,207 @@ void ScanlineRenderer::load_colors(const bn::span<const bn::color>& colors)
             _palettes[palette_index].set_colors(palette_item);
         }
     }
+#if STR_WINDOW_SPANS
+    if(_window_fills)
+    {
+        _load_window_fill_colors();
+        bn::bg_palette_ptr palette = _window_fills->first_bg.palette();
+        palette.set_colors(
+            bn::bg_palette_item(bn::span<const bn::color>(_window_fill_colors, _window_fill_colors_count),
+                                bn::bpp_mode::BPP_8));
+    }
+#endif
+}
+void ScanlineRenderer::set_window_spans_enabled(bool enabled)
+{
+#if STR_WINDOW_SPANS
+    if(enabled == _window_spans_enabled)
+    {
+        return;
+    }
+    _window_spans_enabled = enabled;
+    bn::memory::clear(bn::display::height(), *_window_span_counts);
+    if(! enabled)
+    {
+        _window_fills.reset();
+        return;
+    }
+    for(int row = 0; row < _window_fill_tiles_count * 8; ++row)
+    {
+        uint32_t row_data = uint32_t(bn::min(row, _window_fill_rows - 1) + 1) * 0x01010101;
+        bn::tile& tile = _window_fill_tiles[((row / 8) * 2) + ((row % 8) / 4)];
+        tile.data[(row % 4) * 2] = row_data;
+        tile.data[((row % 4) * 2) + 1] = row_data;
+    }
+    for(int cell_y = 0; cell_y < _window_fill_tiles_count; ++cell_y)
+    {
+        bn::regular_bg_map_cell* row_cells = _window_fill_cells + (cell_y * _window_fill_map_size);
+        for(int cell_x = 0; cell_x < _window_fill_map_size; ++cell_x)
+        {
+            row_cells[cell_x] = bn::regular_bg_map_cell(cell_y);
+        }
+    }
+    _load_window_fill_colors();
+    bn::regular_bg_item bg_item(
+        bn::regular_bg_tiles_item(bn::span<const bn::tile>(_window_fill_tiles, _window_fill_tiles_count * 2),
+                                  bn::bpp_mode::BPP_8),
+        bn::bg_palette_item(bn::span<const bn::color>(_window_fill_colors, _window_fill_colors_count),
+                            bn::bpp_mode::BPP_8),
+        bn::regular_bg_map_item(_window_fill_cells[0], bn::size(_window_fill_map_size, _window_fill_map_size)));
+    _window_fills.emplace(bg_item);
+#else
+    BN_ASSERT(! enabled, "Window spans are compiled out, build with WINDOW_SPANS=1");
+#endif
+}
+void ScanlineRenderer::set_wide_spans_enabled(bool enabled)
+{
+    if(enabled == _wide_spans_enabled)
+    {
+        return;
+    }
+    _wide_spans_enabled = enabled;
+    if(! enabled)
+    {
+        _wide_span_affine_mats.clear();
+        return;
+    }
+    constexpr int half_size = 32;
+    constexpr int wide_span_sprites_count = _max_wide_span_length - _min_wide_span_length + 1;
+    for(WideSpanSprite& wide_span_sprite : _wide_span_sprites)
+    {
+        wide_span_sprite.row = 0xFF;
+    }
+    for(bn::fixed horizontal_scale : wide_span_horizontal_scales)
+    {
+        bn::sprite_affine_mat_ptr affine_mat = bn::sprite_affine_mat_ptr::create();
+        BN_ASSERT(affine_mat.id() < RendererCapacities::max_affine_mat_ids,
+                  "Wide span affine mat overwritten by HDMA: ", affine_mat.id());
+        affine_mat.set_horizontal_scale(horizontal_scale);
+        int pa = affine_mat.attributes().pa_register_value();
+        int attr1 = bn::hw::sprites::second_attributes(0, bn::sprite_size::HUGE, affine_mat.id());
+        int left_x = -half_size * 2;
+        while(((pa * left_x) >> 8) + half_size < 0)
+        {
+            ++left_x;
+        }
+        int right_x = left_x;
+        for(int row = 0; row < half_size * 2; ++row)
+        {
+            while(right_x < (half_size * 2) - 1 && ((pa * (right_x + 1)) >> 8) + half_size <= row)
+            {
+                ++right_x;
+            }
+            int index = right_x - left_x - _min_wide_span_length;
+            if(index >= 0 && index < wide_span_sprites_count && _wide_span_sprites[index].row == 0xFF)
+            {
+                _wide_span_sprites[index] = { uint16_t(attr1), uint8_t(row), uint8_t(left_x + (half_size * 2)) };
+            }
+        }
+        _wide_span_affine_mats.push_back(bn::move(affine_mat));
+    }
+    BN_ASSERT(_wide_span_sprites[0].row != 0xFF, "Invalid wide span affine mats");
+    for(int index = 1; index < wide_span_sprites_count; ++index)
+    {
+        if(_wide_span_sprites[index].row == 0xFF)
+        {
+            _wide_span_sprites[index] = _wide_span_sprites[index - 1];
+        }
+    }
+}
+void ScanlineRenderer::begin_frame()
+{
+    _frame_active = true;
+    _merged_spans_count = 0;
+    _dropped_spans_count = 0;
+    bn::memory::clear(bn::display::height(), *_last_scanline_spans);
+    bn::memory::clear(bn::display::height(), *_scanline_overflow_counts);
+    if(_span_coverage_enabled)
+    {
+        bn::memory::clear(bn::display::height(), *_coverage_interval_counts);
+    }
+#if STR_WINDOW_SPANS
+    if(_window_spans_enabled)
+    {
+        bn::memory::clear(bn::display::height(), *_window_span_counts);
+    }
+#endif
+}
+void ScanlineRenderer::log_overflows() const
+{
+    BN_LOG("Scanline spans dropped: ", _dropped_spans_count, " merged: ", _merged_spans_count);
+    for(int y = 0; y < bn::display::height(); ++y)
+    {
+        if(_scanline_overflow_counts[y])
+        {
+            BN_LOG("    y: ", y, " dropped: ", _scanline_overflow_counts[y]);
+        }
+    }
 }
 void ScanlineRenderer::commit_frame()
 {
     if(! _frame_active)
     {
+        _frame_committed = false;
         _stop_hdma();
+#if STR_WINDOW_SPANS
+        _commit_window_spans();
+#endif
         return;
     }
+#if STR_WINDOW_SPANS
+    _commit_window_spans();
+#endif
     uint16_t* hdma_source = _hdma_source;
     _frame_active = false;
-    if(hdma_source == _hdma_source_a)
-    {
-        _hide_left_scanline_sprites(_previous_scanline_sprite_counts_a);
-    }
-    else
+    _frame_committed = true;
+    int used_slots = 0;
+    for(int y = 0; y < bn::display::height(); ++y)
     {
-        _hide_left_scanline_sprites(_previous_scanline_sprite_counts_b);
+        used_slots = bn::max(used_slots, int(_scanline_sprite_counts[y]));
     }
-    int scanline_elements = _max_hdma_sprites * 4;
+    int transfer_slots = bn::max(bn::max(used_slots, _previous_used_slots), 1);
+    _previous_used_slots = used_slots;
+    _pack_scanline_sprites(transfer_slots);
+    int scanline_elements = transfer_slots * 4;
     int hdma_source_size = bn::display::height() * scanline_elements;
     bn::memory::copy(hdma_source[0], scanline_elements, hdma_source[hdma_source_size]);
-    bn::span<const uint16_t> hdma_source_ref(hdma_source + scanline_elements, hdma_source_size);
-    bn::hdma::start(hdma_source_ref, *bn::hw::sprites::first_attributes_register(_oam_start_index));
+    _start_hdma(hdma_source, transfer_slots);
     if(hdma_source == _hdma_source_a)
     {
-        bn::memory::copy(*_scanline_sprite_counts, bn::display::height(), *_previous_scanline_sprite_counts_a);
+        _hdma_transfer_slots_a = transfer_slots;
         _hdma_source = _hdma_source_b;
     }
     else
     {
-        bn::memory::copy(*_scanline_sprite_counts, bn::display::height(), *_previous_scanline_sprite_counts_b);
+        _hdma_transfer_slots_b = transfer_slots;
         _hdma_source = _hdma_source_a;
     }
     bn::memory::clear(bn::display::height(), *_scanline_sprite_counts);
 }
+void ScanlineRenderer::replay_frame()
+{
+    _frame_active = false;
+    if(! _frame_committed)
+    {
+        _stop_hdma();
+        return;
+    }
+    if(_hdma_source == _hdma_source_a)
+    {
+        _start_hdma(_hdma_source_b, _hdma_transfer_slots_b);
+    }
+    else
+    {
+        _start_hdma(_hdma_source_a, _hdma_transfer_slots_a);
+    }
+}
+void ScanlineRenderer::_start_hdma(const uint16_t* hdma_source, int transfer_slots)
+{
+    int scanline_elements = transfer_slots * 4;
+    int hdma_source_size = bn::display::height() * scanline_elements;
+    bn::span<const uint16_t> hdma_source_ref(hdma_source + scanline_elements, hdma_source_size);
+    bn::hdma::start(hdma_source_ref, *bn::hw::sprites::first_attributes_register(_oam_start_index));
+}
 void ScanlineRenderer::_stop_hdma()
 {
     if(bn::hdma::running())
@@ -306,6 +747,446 @@ void ScanlineRenderer::_stop_hdma()
         bn::sprites::reload();
     }
 }
+#if STR_WINDOW_SPANS
+void ScanlineRenderer::_load_window_fill_colors()
+{
+    int colors_count = _color_tiles.size();
+    for(int shading = 0; shading < _max_palettes; ++shading)
+    {
+        for(int color_index = 0; color_index < colors_count; ++color_index)
+        {
+            int fill_color_index = (shading * fr::face_3d::max_colors) + color_index + 1;
+            _window_fill_colors[fill_color_index] = brightness_color(_colors[color_index], 25 + shading);
+        }
+    }
+}
+void ScanlineRenderer::_commit_window_spans()
+{
+    if(! _window_fills)
+    {
+        return;
+    }
+    WindowFills& window_fills = *_window_fills;
+    int buffer_index = window_fills.buffer_index;
+    constexpr int half_width = bn::display::width() / 2;
+    for(int window_index = 0; window_index < _max_window_spans; ++window_index)
+    {
+        bn::fixed* positions = window_fills.positions[buffer_index][window_index];
+        bn::pair<bn::fixed, bn::fixed>* boundaries = window_fills.boundaries[buffer_index][window_index];
+        for(int y = 0; y < bn::display::height(); ++y)
+        {
+            if(window_index < _window_span_counts[y])
+            {
+                const WindowSpan& window_span = _window_spans[y][window_index];
+                int row = (window_span.shading * fr::face_3d::max_colors) + window_span.color_index;
+                positions[y] = window_fill_vertical_offset + y - row;
+                boundaries[y] = bn::pair<bn::fixed, bn::fixed>(
+                    window_span.left_x - half_width, window_span.right_x + 1 - half_width);
+            }
+            else
+            {
+                positions[y] = 0;
+                boundaries[y] = bn::pair<bn::fixed, bn::fixed>(0, 0);
+            }
+        }
+    }
+    window_fills.first_position_hbe.set_deltas_ref(window_fills.positions[buffer_index][0]);
+    window_fills.second_position_hbe.set_deltas_ref(window_fills.positions[buffer_index][1]);
+    window_fills.first_boundaries_hbe.set_deltas_ref(window_fills.boundaries[buffer_index][0]);
+    window_fills.second_boundaries_hbe.set_deltas_ref(window_fills.boundaries[buffer_index][1]);
+    window_fills.buffer_index = buffer_index ^ 1;
+}
+#endif
+AffineFloorRenderer::AffineFloorRenderer()
+{
+    for(int tile_index = 0; tile_index < _tiles_count; ++tile_index)
+    {
+        uint32_t tile_data = uint32_t(tile_index) * 0x01010101;
+        for(int half_index = 0; half_index < 2; ++half_index)
+        {
+            for(uint32_t& data : _tiles[(tile_index * 2) + half_index].data)
+            {
+                data = tile_data;
+            }
+        }
+    }
+}
+void AffineFloorRenderer::load_colors(const bn::span<const bn::color>& colors)
+{
+    int colors_count = colors.size();
+    BN_ASSERT(colors_count <= fr::face_3d::max_colors, "Invalid colors count: ", colors_count);
+    for(int color_index = 0; color_index < colors_count; ++color_index)
+    {
+        _colors[color_index] = colors[color_index];
+    }
+    _colors_count = colors_count;
+    _shading = -1;
+}
+void AffineFloorRenderer::set_enabled(bool enabled)
+{
+    if(enabled == _bg.has_value())
+    {
+        return;
+    }
+    if(! enabled)
+    {
+        _stop_hdma();
+        _floor_committed = false;
+        _bg_map.reset();
+        _bg.reset();
+        return;
+    }
+    bn::affine_bg_item bg_item(
+        bn::affine_bg_tiles_item(bn::span<const bn::tile>(_tiles, _tiles_count * 2)),
+        bn::bg_palette_item(bn::span<const bn::color>(_palette_colors, _palette_colors_count), bn::bpp_mode::BPP_8),
+        bn::affine_bg_map_item(_cells[0], bn::size(_map_size, _map_size)));
+    _bg = bg_item.create_bg(0, 0);
+    _bg->set_priority(3);
+    _bg->set_wrapping_enabled(false);
+    _bg->set_visible(false);
+    _bg_map = _bg->map();
+    _floor_item = nullptr;
+    _shading = -1;
+}
+void AffineFloorRenderer::commit_frame()
+{
+    if(! _floor_added)
+    {
+        if(_floor_committed)
+        {
+            _floor_committed = false;
+            _stop_hdma();
+            _bg->set_visible(false);
+        }
+        return;
+    }
+    uint16_t* hdma_source = _hdma_source;
+    _floor_added = false;
+    _floor_committed = true;
+    bn::memory::copy(hdma_source[0], _hdma_line_elements,
+                     hdma_source[bn::display::height() * _hdma_line_elements]);
+    _start_hdma(hdma_source);
+    _hdma_source = hdma_source == _hdma_source_a ? _hdma_source_b : _hdma_source_a;
+    _bg->set_visible(true);
+}
+void AffineFloorRenderer::replay_frame()
+{
+    if(_floor_committed)
+    {
+        _start_hdma(_hdma_source == _hdma_source_a ? _hdma_source_b : _hdma_source_a);
+    }
+}
+void AffineFloorRenderer::_load_floor(const TiledFloorItem& floor_item, unsigned shading)
+{
+    if(_floor_item != &floor_item)
+    {
+        constexpr int cells_per_tile = _tile_texels / 8;
+        int columns = floor_item.columns();
+        int rows = floor_item.rows();
+        _floor_item = &floor_item;
+        bn::memory::clear(_cells);
+        for(int cell_y = 0, cells_height = rows * cells_per_tile; cell_y < cells_height; ++cell_y)
+        {
+            bn::affine_bg_map_cell* row_cells = _cells + (cell_y * _map_size);
+            for(int cell_x = 0, cells_width = columns * cells_per_tile; cell_x < cells_width; ++cell_x)
+            {
+                int color_index = floor_item.tile_color(cell_x / cells_per_tile, cell_y / cells_per_tile);
+                row_cells[cell_x] = bn::affine_bg_map_cell(color_index + 1);
+            }
+        }
+        _bg_map->reload_cells_ref();
+    }
+    if(_shading != int(shading))
+    {
+        _shading = int(shading);
+        for(int color_index = 0; color_index < _colors_count; ++color_index)
+        {
+            _palette_colors[color_index + 1] = brightness_color(_colors[color_index], 25 + int(shading));
+        }
+        bn::bg_palette_ptr palette = _bg->palette();
+        palette.set_colors(
+            bn::bg_palette_item(bn::span<const bn::color>(_palette_colors, _palette_colors_count),
+                                bn::bpp_mode::BPP_8));
+    }
+}
+void AffineFloorRenderer::_start_hdma(const uint16_t* hdma_source)
+{
+    bn::span<const uint16_t> hdma_source_ref(hdma_source + _hdma_line_elements,
+                                             bn::display::height() * _hdma_line_elements);
+    bn::hdma::high_priority_start(hdma_source_ref, *reinterpret_cast<uint16_t*>(bg2_affine_registers_address));
+}
+void AffineFloorRenderer::_stop_hdma()
+{
+    if(bn::hdma::high_priority_running())
+    {
+        bn::hdma::high_priority_stop();
+    }
+}
+#if STR_WINDOW_SPANS
+ScanlineRenderer::WindowFills::WindowFills(const bn::regular_bg_item& bg_item) :
+    first_bg(bg_item.create_bg(0, 0)),
+    second_bg(bg_item.create_bg(0, 0)),
+    first_position_hbe(bn::regular_bg_position_hbe_ptr::create_vertical(first_bg, positions[0][0])),
+    second_position_hbe(bn::regular_bg_position_hbe_ptr::create_vertical(second_bg, positions[0][1])),
+    first_boundaries_hbe(bn::rect_window_boundaries_hbe_ptr::create_horizontal(
+        bn::rect_window::internal(), boundaries[0][0])),
+    second_boundaries_hbe(bn::rect_window_boundaries_hbe_ptr::create_horizontal(
+        bn::rect_window::external(), boundaries[0][1]))
+{
+    constexpr int half_height = bn::display::height() / 2;
+    first_bg.set_priority(3);
+    second_bg.set_priority(3);
+    bn::rect_window internal_window = bn::rect_window::internal();
+    internal_window.set_top(-half_height);
+    internal_window.set_bottom(half_height);
+    internal_window.set_show_bg(second_bg, false);
+    bn::rect_window external_window = bn::rect_window::external();
+    external_window.set_top(-half_height);
+    external_window.set_bottom(half_height);
+    external_window.set_show_bg(first_bg, false);
+    bn::window outside_window = bn::window::outside();
+    outside_window.set_show_bg(first_bg, false);
+    outside_window.set_show_bg(second_bg, false);
+}
+ScanlineRenderer::WindowFills::~WindowFills()
+{
+    bn::rect_window::internal().set_boundaries(0, 0, 0, 0);
+    bn::rect_window::external().set_boundaries(0, 0, 0, 0);
+}
+#endif
+BitmapRenderer::BitmapRenderer() :
+    _reserved_sprite_tiles(bn::sprite_tiles_ptr::allocate(bitmap_reserved_sprite_tiles_count, bn::bpp_mode::BPP_4)),
+    _back_page(reinterpret_cast<uint16_t*>(bitmap_pages_address + bitmap_page_size))
+{
+    BN_ASSERT(! _reserved_sprite_tiles.id(), "Sprite tiles were allocated before the bitmap renderer");
+    for(int page = 0; page < 2; ++page)
+    {
+        for(uint16_t& display_control : _display_controls[page])
+        {
+            display_control = bitmap_display_control | (page ? bitmap_page_select : 0);
+        }
+    }
+}
+void BitmapRenderer::load_colors(const bn::span<const bn::color>& colors)
+{
+    int colors_count = colors.size();
+    BN_ASSERT(colors_count <= fr::face_3d::max_colors, "Invalid colors count: ", colors_count);
+    for(int shading = 0; shading < _max_shading_levels; ++shading)
+    {
+        for(int color_index = 0; color_index < colors_count; ++color_index)
+        {
+            int palette_color_index = (shading * fr::face_3d::max_colors) + color_index + 1;
+            _palette_colors[palette_color_index] = brightness_color(colors[color_index], 25 + shading);
+        }
+    }
+    bn::bg_palette_item palette_item(bn::span<const bn::color>(_palette_colors, _palette_colors_count),
+                                     bn::bpp_mode::BPP_8);
+    if(_palette)
+    {
+        _palette->set_colors(palette_item);
+    }
+    else
+    {
+        _palette = palette_item.create_new_palette();
+        BN_ASSERT(! _palette->id(), "Bitmap palette must start at BG color 0");
+    }
+}
+void BitmapRenderer::log_overflows() const
+{
+    BN_LOG("Bitmap sprites dropped: ", _dropped_sprites_count);
+}
+void BitmapRenderer::add_sprite(unsigned, unsigned, uint16_t attr0, uint16_t attr1, uint16_t attr2)
+{
+    if(_sprites_count == _max_sprites) [[unlikely]]
+    {
+        ++_dropped_sprites_count;
+        return;
+    }
+    uint16_t* sprite_attributes = _sprite_attributes[_sprites_count];
+    sprite_attributes[0] = attr0;
+    sprite_attributes[1] = attr1;
+    sprite_attributes[2] = attr2;
+    ++_sprites_count;
+}
+void BitmapRenderer::commit_frame()
+{
+    if(! _frame_active)
+    {
+        _frame_committed = false;
+        _stop_hdma();
+        return;
+    }
+    _frame_active = false;
+    _frame_committed = true;
+    _front_page ^= 1;
+    _back_page = reinterpret_cast<uint16_t*>(bitmap_pages_address + ((_front_page ^ 1) * bitmap_page_size));
+    _commit_sprites();
+    _start_hdma();
+}
+void BitmapRenderer::replay_frame()
+{
+    _frame_active = false;
+    if(! _frame_committed)
+    {
+        _stop_hdma();
+        return;
+    }
+    _start_hdma();
+}
+void BitmapRenderer::_commit_sprites()
+{
+    for(int sprite_index = 0; sprite_index < _sprites_count; ++sprite_index)
+    {
+        uint16_t* sprite_attributes = bn::hw::sprites::first_attributes_register(_oam_start_index + sprite_index);
+        sprite_attributes[0] = _sprite_attributes[sprite_index][0];
+        sprite_attributes[1] = _sprite_attributes[sprite_index][1];
+        sprite_attributes[2] = _sprite_attributes[sprite_index][2];
+    }
+    for(int sprite_index = _sprites_count; sprite_index < _committed_sprites_count; ++sprite_index)
+    {
+        bn::hw::sprites::hide(*bn::hw::sprites::first_attributes_register(_oam_start_index + sprite_index));
+    }
+    _committed_sprites_count = _sprites_count;
+}
+void BitmapRenderer::_start_hdma()
+{
+    bn::hdma::start(bn::span<const uint16_t>(_display_controls[_front_page]),
+                    *reinterpret_cast<uint16_t*>(display_control_address));
+}
+void BitmapRenderer::_stop_hdma()
+{
+    if(bn::hdma::running())
+    {
+        bn::hdma::stop();
+        for(int sprite_index = 0; sprite_index < _committed_sprites_count; ++sprite_index)
+        {
+            bn::hw::sprites::hide(*bn::hw::sprites::first_attributes_register(_oam_start_index + sprite_index));
+        }
+        _committed_sprites_count = 0;
+        bn::sprites::reload();
+    }
+}
+void ShellImpostor::load_colors(const bn::span<const bn::color>& colors)
+{
+    int colors_count = colors.size();
+    BN_ASSERT(colors_count <= fr::face_3d::max_colors, "Invalid colors count: ", colors_count);
+    for(int shading = 0; shading < _max_shading_levels; ++shading)
+    {
+        for(int color_index = 0; color_index < colors_count; ++color_index)
+        {
+            int palette_color_index = (shading * fr::face_3d::max_colors) + color_index + 1;
+            _palette_colors[palette_color_index] = brightness_color(colors[color_index], 25 + shading);
+        }
+    }
+    if(_bg)
+    {
+        bn::bg_palette_ptr palette = _bg->palette();
+        palette.set_colors(
+            bn::bg_palette_item(bn::span<const bn::color>(_palette_colors, _palette_colors_count),
+                                bn::bpp_mode::BPP_8));
+    }
+}
+void ShellImpostor::set_enabled(bool enabled)
+{
+    if(enabled == _bg.has_value())
+    {
+        return;
+    }
+    _valid = false;
+    _failed = false;
+    if(! enabled)
+    {
+        _bg_tiles.reset();
+        _bg_map.reset();
+        _bg.reset();
+        _buffers.reset();
+        return;
+    }
+    _buffers.reset(new Buffers());
+    bn::memory::clear(_max_tiles * 2, _buffers->tiles[0]);
+    bn::memory::clear(_map_size * _map_size, _cells[0]);
+    bn::regular_bg_item bg_item(
+        bn::regular_bg_tiles_item(bn::span<const bn::tile>(_buffers->tiles, _max_tiles * 2), bn::bpp_mode::BPP_8),
+        bn::bg_palette_item(bn::span<const bn::color>(_palette_colors, _palette_colors_count), bn::bpp_mode::BPP_8),
+        bn::regular_bg_map_item(_cells[0], bn::size(_map_size, _map_size)));
+    _bg = bg_item.create_bg(0, 0);
+    _bg->set_priority(3);
+    _bg->set_visible(false);
+    _bg_map = _bg->map();
+    _bg_tiles = _bg->tiles();
+}
+void ShellImpostor::invalidate()
+{
+    if(_valid)
+    {
+        _bg->set_visible(false);
+    }
+    _valid = false;
+    _failed = false;
+}
+void ShellImpostor::begin_bake()
+{
+    bn::memory::clear(bn::display::width() * bn::display::height(), _buffers->pixels[0][0]);
+}
+void ShellImpostor::finish_bake()
+{
+    constexpr int columns = bn::display::width() / 8;
+    constexpr int rows = bn::display::height() / 8;
+    int16_t solid_tile_indexes[_palette_colors_count];
+    for(int16_t& solid_tile_index : solid_tile_indexes)
+    {
+        solid_tile_index = -1;
+    }
+    solid_tile_indexes[0] = 0;
+    int tiles_count = 1;
+    uint8_t (&pixels)[bn::display::height()][bn::display::width()] = _buffers->pixels;
+    bn::tile* tiles = _buffers->tiles;
+    for(int row = 0; row < rows; ++row)
+    {
+        bn::regular_bg_map_cell* row_cells = _cells + ((row + _map_rows_offset) * _map_size) + _map_columns_offset;
+        for(int column = 0; column < columns; ++column)
+        {
+            const uint8_t* first_pixel = &pixels[row * 8][column * 8];
+            uint32_t solid_word = first_pixel[0] * 0x01010101u;
+            bool solid = true;
+            for(int tile_row = 0; tile_row < 8 && solid; ++tile_row)
+            {
+                const uint32_t* words =
+                        reinterpret_cast<const uint32_t*>(first_pixel + (tile_row * bn::display::width()));
+                solid = words[0] == solid_word && words[1] == solid_word;
+            }
+            int16_t* solid_tile_index = solid ? &solid_tile_indexes[first_pixel[0]] : nullptr;
+            if(solid_tile_index && *solid_tile_index >= 0)
+            {
+                row_cells[column] = bn::regular_bg_map_cell(*solid_tile_index);
+                continue;
+            }
+            if(tiles_count == _max_tiles)
+            {
+                _failed = true;
+                return;
+            }
+            for(int tile_row = 0; tile_row < 8; ++tile_row)
+            {
+                const uint32_t* words =
+                        reinterpret_cast<const uint32_t*>(first_pixel + (tile_row * bn::display::width()));
+                bn::tile& tile = tiles[(tiles_count * 2) + (tile_row / 4)];
+                tile.data[(tile_row % 4) * 2] = words[0];
+                tile.data[((tile_row % 4) * 2) + 1] = words[1];
+            }
+            if(solid_tile_index)
+            {
+                *solid_tile_index = int16_t(tiles_count);
+            }
+            row_cells[column] = bn::regular_bg_map_cell(tiles_count);
+            ++tiles_count;
+        }
+    }
+    _bg_tiles->reload_tiles_ref();
+    _bg_map->reload_cells_ref();
+    _bg->set_visible(true);
+    _valid = true;
+}
 ScanlineRenderer::ColorTiles::ColorTiles(
         const bn::sprite_tiles_item& small_item, const bn::sprite_tiles_item& normal_item,
         const bn::sprite_tiles_item& big_item, const bn::sprite_tiles_item& huge_item) :
@@ -322,30 +1203,48 @@ void ScanlineRenderer::ColorTileIds::load(const ColorTiles& color_tiles)
     big_tiles_id = uint16_t(color_tiles.big_tiles.id());
     huge_tiles_id = uint16_t(color_tiles.huge_tiles.id());
 }
-Model& Renderer::create_model(const fr::model_3d_item& model_item)
+Model& Renderer::create_model(const fr::model_3d_item& model_item, const TiledFloorItem* floor_item,
+                              const ModelBounds* bounds)
+{
+    int model_vertices_count = model_item.vertices().size();
+    int model_faces_count = model_item.faces().size() + (floor_item ? 1 : 0);
+    BN_ASSERT(! _models_pool.full(), "There's no space for more dynamic models");
+    BN_ASSERT(model_vertices_count + _vertices_count <= _max_vertices, "There's no space for more vertices");
+    BN_ASSERT(model_faces_count + _faces_count <= _max_faces, "There's no space for more faces");
+    return _add_model(_models_pool.create(model_item, floor_item, bounds));
+}
+Model& Renderer::create_model(const bn::span<const ModelLod>& lods, const ModelBounds& bounds)
 {
+    BN_ASSERT(! lods.empty(), "Empty model LODs");
+    const fr::model_3d_item& model_item = lods[0].item();
     int model_vertices_count = model_item.vertices().size();
     int model_faces_count = model_item.faces().size();
     BN_ASSERT(! _models_pool.full(), "There's no space for more dynamic models");
     BN_ASSERT(model_vertices_count + _vertices_count <= _max_vertices, "There's no space for more vertices");
     BN_ASSERT(model_faces_count + _faces_count <= _max_faces, "There's no space for more faces");
-    Model& result = _models_pool.create(model_item);
-    _models_list.push_back(result);
-    _vertices_count += model_vertices_count;
-    _faces_count += model_faces_count;
+    return _add_model(_models_pool.create(lods, bounds));
+}
+Model& Renderer::_add_model(Model& model)
+{
+    _models_list.push_back(model);
+    _vertices_count += model.reserved_vertices_count();
+    _faces_count += model.reserved_render_items_count();
+    _model_faces_count += model.reserved_render_items_count();
     ++_models_revision;
     _geometry_cache_valid = false;
-    return result;
+    _frame_replay_valid = false;
+    return model;
 }
 void Renderer::destroy_model(Model& model)
 {
-    const fr::model_3d_item& model_item = model.item();
-    _vertices_count -= model_item.vertices().size();
-    _faces_count -= model_item.faces().size();
+    _vertices_count -= model.reserved_vertices_count();
+    _faces_count -= model.reserved_render_items_count();
+    _model_faces_count -= model.reserved_render_items_count();
     _models_list.erase(model);
     _models_pool.destroy(model);
     ++_models_revision;
     _geometry_cache_valid = false;
+    _frame_replay_valid = false;
 }
 Sprite& Renderer::create_sprite(SpriteItem& sprite_item)
 {
@@ -356,6 +1255,7 @@ Sprite& Renderer::create_sprite(SpriteItem& sprite_item)
     _sprites_list.push_back(result);
     ++_vertices_count;
     ++_faces_count;
+    _frame_replay_valid = false;
     return result;
 }
 void Renderer::destroy_sprite(Sprite& sprite)
@@ -364,10 +1264,64 @@ void Renderer::destroy_sprite(Sprite& sprite)
     --_faces_count;
     _sprites_list.erase(sprite);
     _sprites_pool.destroy(sprite);
+    _frame_replay_valid = false;
+}
+BillboardBatch& Renderer::create_billboard_batch(const bn::sprite_item& item)
+{
+    BN_ASSERT(! _billboard_batches_pool.full(), "There's no space for more billboard batches");
+    BillboardBatch& result = _billboard_batches_pool.create(item);
+    _billboard_batches_list.push_back(result);
+    _frame_replay_valid = false;
+    return result;
+}
+void Renderer::destroy_billboard_batch(BillboardBatch& billboard_batch)
+{
+    _billboard_batches_list.erase(billboard_batch);
+    _billboard_batches_pool.destroy(billboard_batch);
+    _frame_replay_valid = false;
+}
+void Renderer::_set_oam_sprite(int oam_sprite_index, const bn::sprite_shape_size& shape_size,
+                               const bn::sprite_tiles_ptr& tiles, const bn::sprite_palette_ptr& palette,
+                               int affine_mat_index, int x, int y)
+{
+    const bn::sprite_affine_mat_ptr& affine_mat = _sprite_affine_mats.affine_mat(affine_mat_index);
+    int half_canvas_size = shape_size.width();
+    bn::fixed sprite_x = x + half_canvas_size - (bn::display::width() / 2);
+    bn::fixed sprite_y = y + half_canvas_size - (bn::display::height() / 2);
+    if(oam_sprite_index == _oam_sprites.size())
+    {
+        bn::sprite_ptr oam_sprite = bn::sprite_ptr::create(sprite_x, sprite_y, shape_size, tiles, palette);
+        oam_sprite.set_affine_mat(affine_mat);
+        oam_sprite.set_double_size_mode(bn::sprite_double_size_mode::ENABLED);
+        oam_sprite.set_bg_priority(3);
+        _oam_sprites.push_back(bn::move(oam_sprite));
+        return;
+    }
+    bn::sprite_ptr& oam_sprite = _oam_sprites[oam_sprite_index];
+    oam_sprite.set_tiles(tiles, shape_size);
+    oam_sprite.set_palette(palette);
+    oam_sprite.set_affine_mat(affine_mat);
+    oam_sprite.set_position(sprite_x, sprite_y);
+}
+void Renderer::_commit_oam_sprites(int oam_sprites_count)
+{
+    _oam_sprites.shrink(oam_sprites_count);
 }
 void Renderer::render(const Camera& camera)
 {
-    _render_frame(camera);
-    _scanline_renderer.commit_frame();
+    if(_render_frame(camera))
+    {
+        _span_renderer.commit_frame();
+        _affine_floor_renderer.commit_frame();
+        if(BN_CFG_LOG_ENABLED && _span_renderer.dropped_spans_count())
+        {
+            _span_renderer.log_overflows();
+        }
+    }
+    else
+    {
+        _span_renderer.replay_frame();
+        _affine_floor_renderer.replay_frame();
+    }
 }
 }
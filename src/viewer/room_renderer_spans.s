@@ -0,0 +1,91 @@
+@ Emits single-segment, unclipped scanline spans. Mirrors the C++ path in
+@ ScanlineRenderer::add_scanline_spans and returns the number of lines written;
+@ it stops at the first line without a free slot or whose last span could be
+@ merged with the new one, so the caller can apply the overflow and merge
+@ policies to the remaining lines.
+@
+@ r0: const ScanlineSpanKernelArgs*
+@     { spans, hdma_source, sprite_counts, slots, last_spans, lines_count, y, attr0, attr1, attr2,
+@       last_span_attributes, last_span_key, merge_key, max_slots, hdma_line_stride, slots_line_stride,
+@       last_span_stride }
+@ Each slot is a halfword: priority (span width) in the low byte, left x in the high byte.
+@ Each last span record is three words: left x | right x << 16, attr1 | attr2 << 16 and
+@ slots end | color index << 8 | shading << 16 | length limit << 24.
+
+    .section .iwram, "ax", %progbits
+    .arm
+    .align 2
+    .global str_scanline_emit_spans
+    .type str_scanline_emit_spans, %function
+str_scanline_emit_spans:
+    push    {r4-r11, lr}
+    ldmia   r0, {r1-r7}
+    cmp     r6, #0
+    beq     .Lscanline_emit_spans_done
+.Lscanline_emit_spans_loop:
+    ldrb    r8, [r3]
+    ldr     r11, [r0, #52]
+    cmp     r8, r11
+    bhs     .Lscanline_emit_spans_done
+    ldmia   r1!, {r9, r10}
+    ldr     r11, [r5, #8]
+    and     r12, r11, #255
+    cmp     r12, r8
+    bne     .Lscanline_emit_spans_emit
+    cmp     r12, #0
+    beq     .Lscanline_emit_spans_emit
+    mov     r11, r11, lsl #8
+    mov     r11, r11, lsr #16
+    ldr     r12, [r0, #48]
+    cmp     r11, r12
+    bne     .Lscanline_emit_spans_emit
+    ldr     r11, [r5]
+    mov     r12, r11, lsl #16
+    mov     r12, r12, asr #16
+    sub     r12, r12, #1
+    cmp     r10, r12
+    blt     .Lscanline_emit_spans_emit
+    mov     r11, r11, asr #16
+    add     r11, r11, #1
+    cmp     r9, r11
+    ble     .Lscanline_emit_spans_done
+.Lscanline_emit_spans_emit:
+    sub     r11, r10, r9
+    add     r12, r11, #1
+    orr     r12, r12, r9, lsl #8
+    add     lr, r4, r8, lsl #1
+    strh    r12, [lr]
+    cmp     r11, #1
+    movlt   r11, #1
+    sub     r11, r7, r11
+    and     r11, r11, #255
+    ldr     r12, [r0, #28]
+    orr     r11, r11, r12
+    ldr     r12, [r0, #32]
+    add     r12, r12, r9
+    orr     r11, r11, r12, lsl #16
+    ldr     r12, [r0, #36]
+    add     lr, r2, r8, lsl #3
+    stmia   lr, {r11, r12}
+    add     r8, r8, #1
+    strb    r8, [r3], #1
+    orr     r11, r9, r10, lsl #16
+    ldr     r12, [r0, #40]
+    ldr     lr, [r0, #44]
+    orr     lr, lr, r8
+    stmia   r5, {r11, r12, lr}
+    ldr     r11, [r0, #56]
+    add     r2, r2, r11
+    ldr     r11, [r0, #60]
+    add     r4, r4, r11
+    ldr     r11, [r0, #64]
+    add     r5, r5, r11
+    add     r7, r7, #1
+    subs    r6, r6, #1
+    bne     .Lscanline_emit_spans_loop
+.Lscanline_emit_spans_done:
+    ldr     r0, [r0, #20]
+    sub     r0, r0, r6
+    pop     {r4-r11, lr}
+    bx      lr
+    .size str_scanline_emit_spans, . - str_scanline_emit_spans
@@ -34,7 +34,7 @@
 #include "fr_sin_cos.h"
 #include "fr_div_lut.h"
 #include "models/str_model_3d_items_room.h"
-#include "models/str_model_3d_items_books.h"
+#include "models/str_model_3d_items_books_lods.h"
 #include "private/viewer/str_room_renderer.h"
 #include "private/viewer/runtime/room_viewer_runtime_systems_shared.h"
 namespace
@@ -111,6 +111,11 @@ namespace str
     bn::bg_palettes::set_transparent_color(bn::color(2, 2, 4));
     int current_room = SPAWN_ROOM_ID;
     _models.load_colors(str::model_3d_items::room_model_colors);
+    _models.set_span_coverage_enabled(ENABLE_SPAN_COVERAGE);
+    _models.set_affine_floor_enabled(ENABLE_AFFINE_FLOOR);
+    _models.set_window_spans_enabled(ENABLE_WINDOW_SPANS);
+    _models.set_wide_spans_enabled(ENABLE_WIDE_SPANS);
+    _models.set_shell_impostor_enabled(ENABLE_SHELL_IMPOSTOR);
     rv::Model* room_models[NUM_ROOMS] = {};
     rv::Model* decor_ptr = nullptr;
     int decor_room = -1;
@@ -197,15 +202,14 @@ namespace str
             rv::Model* room_model = room_models[room_id];
             if(!room_model)
             {
-                room_model = &_models.create_model(get_room_model(room_id));
+                room_model = &_models.create_model(get_room_model(room_id), &get_room_floor(room_id),
+                                                   &get_room_bounds(room_id));
                 room_models[room_id] = room_model;
             }
             bool room_perspective_mode = room_id == current_room;
             room_model->set_layering_mode(
                 room_perspective_mode ? rv::Model::LayeringMode::room_perspective :
                                         rv::Model::LayeringMode::room_floor_only);
-            room_model->set_depth_bias(
-                room_id == current_room ? 0 : ADJACENT_ROOM_DEPTH_BIAS);
             room_model->set_double_sided(room_perspective_mode);
         };
         ensure_room_model(current_room);
@@ -235,18 +239,20 @@ namespace str
             decor_room = next_decor_room;
             if(decor_room >= 0)
             {
-                decor_ptr = &_models.create_model(room_decor_model(decor_room));
+                decor_ptr = &_models.create_model(room_decor_lods(decor_room), *room_decor_bounds(decor_room));
             }
         }
         if(decor_ptr)
         {
             decor_ptr->set_layering_mode(rv::Model::LayeringMode::none);
-            decor_ptr->set_depth_bias(decor_room == current_room ? 0 : TRANSITION_DECOR_DEPTH_BIAS);
+            decor_ptr->set_render_layer(
+                decor_room == current_room ? rv::RenderLayer::dynamic : rv::RenderLayer::adjacent_room);
             decor_ptr->set_double_sided(false);
         }
     };
-    rv::Sprite* npc_sprite_a_ptr = nullptr;
-    rv::Sprite* npc_sprite_b_ptr = nullptr;
+    rv::BillboardBatch* npc_billboards_ptr = nullptr;
+    int npc_billboard_a = 0;
+    int npc_billboard_b = 0;
     auto update_all_orientations = [&]() {
         corner_matrix cm = rotate_corner_matrix(base_corner, current_view_angle);
         for(int room_id = 0; room_id < NUM_ROOMS; ++room_id)
@@ -518,16 +524,15 @@ namespace str
     rv::Sprite& player_sprite = _models.create_sprite(player_sprite_item);
     player_sprite.set_scale(PLAYER_SPRITE_SCALE);
     player_sprite.set_horizontal_flip(false);
-    rv::SpriteItem npc_sprite_item_a(bn::sprite_items::villager, 0);
-    rv::SpriteItem npc_sprite_item_b(bn::sprite_items::villager, 0);
-    npc_sprite_item_b.palette() = bn::sprite_items::villager.palette_item().create_new_palette();
-    npc_sprite_item_b.palette().set_color(NPC_PALETTE_HAT_INDEX_0, npc_room_b_hat_color_0);
-    npc_sprite_item_b.palette().set_color(NPC_PALETTE_HAT_INDEX_1, npc_room_b_hat_color_1);
-    npc_sprite_item_b.palette().set_color(NPC_PALETTE_HAT_INDEX_2, npc_room_b_hat_color_2);
-    npc_sprite_a_ptr = &_models.create_sprite(npc_sprite_item_a);
-    npc_sprite_b_ptr = &_models.create_sprite(npc_sprite_item_b);
-    npc_sprite_a_ptr->set_scale(2);
-    npc_sprite_b_ptr->set_scale(2);
+    npc_billboards_ptr = &_models.create_billboard_batch(bn::sprite_items::villager);
+    bn::sprite_palette_ptr npc_palette_b = bn::sprite_items::villager.palette_item().create_new_palette();
+    npc_palette_b.set_color(NPC_PALETTE_HAT_INDEX_0, npc_room_b_hat_color_0);
+    npc_palette_b.set_color(NPC_PALETTE_HAT_INDEX_1, npc_room_b_hat_color_1);
+    npc_palette_b.set_color(NPC_PALETTE_HAT_INDEX_2, npc_room_b_hat_color_2);
+    int npc_palette_b_index = npc_billboards_ptr->add_palette(npc_palette_b);
+    npc_billboard_a = npc_billboards_ptr->add(fr::point_3d(), 2);
+    npc_billboard_b = npc_billboards_ptr->add(fr::point_3d(), 2);
+    npc_billboards_ptr->set_palette_index(npc_billboard_b, npc_palette_b_index);
     int npc_anim_counter = 0;
     update_orientations_and_paintings();
     auto update_player_sprite_position = [&]() {
@@ -542,11 +547,12 @@ namespace str
         player_sprite.set_position(
             transform_global_point(cm, player_global_x, player_global_y, _player_fz));
         constexpr fr::point_3d offscreen_pos(0, -9999, 0);
-        if(npc_sprite_a_ptr)
+        if(npc_billboards_ptr)
         {
             if(room_models[NPC_ROOM_A])
             {
-                npc_sprite_a_ptr->set_position(
+                npc_billboards_ptr->set_position(
+                    npc_billboard_a,
                     transform_global_point(cm,
                                            room_center_x(NPC_ROOM_A) + NPC_FX - world_anchor_x,
                                            room_center_y(NPC_ROOM_A) + NPC_FY - world_anchor_y,
@@ -554,14 +560,12 @@ namespace str
             }
             else
             {
-                npc_sprite_a_ptr->set_position(offscreen_pos);
+                npc_billboards_ptr->set_position(npc_billboard_a, offscreen_pos);
             }
-        }
-        if(npc_sprite_b_ptr)
-        {
             if(room_models[NPC_ROOM_B])
             {
-                npc_sprite_b_ptr->set_position(
+                npc_billboards_ptr->set_position(
+                    npc_billboard_b,
                     transform_global_point(cm,
                                            room_center_x(NPC_ROOM_B) + NPC_FX - world_anchor_x,
                                            room_center_y(NPC_ROOM_B) + NPC_FY - world_anchor_y,
@@ -569,7 +573,7 @@ namespace str
             }
             else
             {
-                npc_sprite_b_ptr->set_position(offscreen_pos);
+                npc_billboards_ptr->set_position(npc_billboard_b, offscreen_pos);
             }
         }
     };
@@ -1001,17 +1005,12 @@ namespace str
             linear8_to_dir(npc_linear, npc_dir, npc_facing_left);
             int npc_anim_frame = (npc_anim_counter / NPC_ANIM_SPEED) % NPC_FRAMES_PER_ANIM;
             int npc_tile_index = npc_dir * NPC_FRAMES_PER_ANIM + npc_anim_frame;
-            if(npc_sprite_a_ptr)
-            {
-                npc_sprite_item_a.tiles().set_tiles_ref(
-                    bn::sprite_items::villager.tiles_item(), npc_tile_index);
-                npc_sprite_a_ptr->set_horizontal_flip(npc_facing_left);
-            }
-            if(npc_sprite_b_ptr)
+            if(npc_billboards_ptr)
             {
-                npc_sprite_item_b.tiles().set_tiles_ref(
-                    bn::sprite_items::villager.tiles_item(), npc_tile_index);
-                npc_sprite_b_ptr->set_horizontal_flip(npc_facing_left);
+                npc_billboards_ptr->set_frame(npc_billboard_a, npc_tile_index);
+                npc_billboards_ptr->set_horizontal_flip(npc_billboard_a, npc_facing_left);
+                npc_billboards_ptr->set_frame(npc_billboard_b, npc_tile_index);
+                npc_billboards_ptr->set_horizontal_flip(npc_billboard_b, npc_facing_left);
             }
             ++npc_anim_counter;
         }